@@ -0,0 +1,187 @@
+#define _POSIX_C_SOURCE 200809L
+#include "utils.h"
+#include <time.h>
+
+#define MANIFEST_LINE_MAX 8192
+
+static char* copy_string(const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = malloc(len);
+    if (!copy) die("malloc path");
+    memcpy(copy, s, len);
+    return copy;
+}
+
+static void add_job(JobList *jobs, const char *in_path, const char *out_path, size_t *capacity) {
+    if ((size_t)jobs->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        jobs->jobs = realloc(jobs->jobs, *capacity * sizeof(Job));
+        if (!jobs->jobs) die("realloc jobs");
+    }
+    jobs->jobs[jobs->count].in_path = copy_string(in_path);
+    jobs->jobs[jobs->count].out_path = copy_string(out_path);
+    jobs->count++;
+}
+
+void jobs_from_args(JobList *jobs, char **paths, int n) {
+    size_t capacity = 0;
+    jobs->jobs = NULL;
+    jobs->count = 0;
+    for (int i = 0; i + 1 < n; i += 2)
+        add_job(jobs, paths[i], paths[i + 1], &capacity);
+}
+
+void jobs_from_manifest(JobList *jobs, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to open manifest: %s\n", path);
+        die("open manifest");
+    }
+
+    size_t capacity = 0;
+    jobs->jobs = NULL;
+    jobs->count = 0;
+
+    // One "input output" pair per line; blank lines and lines starting with '#' are skipped
+    char line[MANIFEST_LINE_MAX], in_path[MANIFEST_LINE_MAX], out_path[MANIFEST_LINE_MAX];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        char *p = line + strspn(line, " \t\r\n");
+        if (*p == '\0' || *p == '#') continue;
+        if (sscanf(p, "%8191s %8191s", in_path, out_path) != 2) {
+            fprintf(stderr, "%s:%d: expected 'input output'\n", path, lineno);
+            exit(1);
+        }
+        add_job(jobs, in_path, out_path, &capacity);
+    }
+    fclose(fp);
+}
+
+// Every input feeds the same output, e.g. one palette shared by many images
+void jobs_from_inputs(JobList *jobs, char **paths, int n, const char *out_path) {
+    size_t capacity = 0;
+    jobs->jobs = NULL;
+    jobs->count = 0;
+    for (int i = 0; i < n; i++)
+        add_job(jobs, paths[i], out_path, &capacity);
+}
+
+void free_jobs(JobList *jobs) {
+    for (int i = 0; i < jobs->count; i++) {
+        free(jobs->jobs[i].in_path);
+        free(jobs->jobs[i].out_path);
+    }
+    free(jobs->jobs);
+    jobs->jobs = NULL;
+    jobs->count = 0;
+}
+
+void workspace_init(Workspace *ws, int bit_depth, int num_threads) {
+    memset(ws, 0, sizeof(*ws));
+    histogram_init(&ws->hist, bit_depth, num_threads);
+}
+
+void workspace_free(Workspace *ws) {
+    histogram_free(&ws->hist);
+    free(ws->pixels);
+    free(ws->rows);
+    free(ws->indices);
+    free(ws->index_rows);
+}
+
+// Point `*rows` at `h` rows of `row_bytes` inside `*data`, growing both only when the image is larger than any before
+static png_bytep* reserve_rows(png_bytep *data, size_t *data_cap, png_bytep **rows, int *rows_cap,
+                               int h, size_t row_bytes) {
+    size_t need = (size_t)h * row_bytes;
+    if (need > *data_cap) {
+        free(*data);
+        *data = malloc(need ? need : 1);
+        if (!*data) die("malloc workspace buffer");
+        stats_count(&run_stats.bytes_allocated, need);
+        *data_cap = need;
+    }
+    if (h > *rows_cap) {
+        free(*rows);
+        *rows = malloc(h * sizeof(png_bytep));
+        if (!*rows) die("malloc workspace rows");
+        stats_count(&run_stats.bytes_allocated, h * sizeof(png_bytep));
+        *rows_cap = h;
+    }
+    for (int y = 0; y < h; y++)
+        (*rows)[y] = *data + y * row_bytes;
+    return *rows;
+}
+
+png_bytep* workspace_decode(Workspace *ws, const char *path, int *w, int *h, int *channels) {
+    PngSource source;
+    png_source_open(&source, path);
+    png_bytep *rows = workspace_decode_source(ws, &source, w, h, channels);
+    png_source_close(&source);
+    return rows;
+}
+
+png_bytep* workspace_decode_source(Workspace *ws, const PngSource *src, int *w, int *h, int *channels) {
+    PngReader reader;
+    png_reader_open_source(&reader, src);
+    *w = reader.w;
+    *h = reader.h;
+    *channels = reader.channels;
+
+    png_bytep *rows = reserve_rows(&ws->pixels, &ws->pixels_cap, &ws->rows, &ws->rows_cap,
+                                   reader.h, reader.row_bytes);
+    png_reader_read_rows(&reader, rows, reader.h);
+    png_reader_close(&reader);
+    return rows;
+}
+
+png_bytep* workspace_index_rows(Workspace *ws, int w, int h) {
+    return reserve_rows(&ws->indices, &ws->indices_cap, &ws->index_rows, &ws->index_rows_cap, h, w);
+}
+
+// A NULL or inactive sampler counts every pixel
+void workspace_collect_colors(Workspace *ws, png_bytep *rows, int w, int h, int channels,
+                              const Sampler *sampler, ColorCounts *out) {
+    histogram_reset(&ws->hist);
+    if (sampler && sampler->active)
+        histogram_add_sampled_rows(&ws->hist, rows, w, h, channels, 0, h, sampler);
+    else
+        histogram_add_rows(&ws->hist, rows, w, h, channels);
+    histogram_colors(&ws->hist, out);
+    stats_count(&run_stats.unique_colors, out->size);
+}
+
+double wall_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void run_batch(const JobList *jobs, const PaletteConfig *config, BatchJobFn fn) {
+    double start = wall_seconds();
+
+    // Whole files are the unit of work: each worker runs every stage of its file single-threaded,
+    // so decode, quantize and encode of different files overlap across the team
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+#ifdef _OPENMP
+        omp_set_num_threads(1);
+#endif
+        Workspace ws;
+        workspace_init(&ws, config->bit_depth, 1);
+
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 1)
+#endif
+        for (int i = 0; i < jobs->count; i++)
+            fn(&ws, &jobs->jobs[i], config);
+
+        workspace_free(&ws);
+    }
+
+    double elapsed = wall_seconds() - start;
+    fprintf(stderr, "processed %d images in %.3f s (%.1f images/sec)\n",
+            jobs->count, elapsed, elapsed > 0 ? jobs->count / elapsed : 0.0);
+}
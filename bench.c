@@ -0,0 +1,269 @@
+#include "utils.h"
+
+#define MAX_SWEEP 16
+
+typedef enum { CONTENT_FLAT, CONTENT_GRADIENT, CONTENT_NOISE, CONTENT_PHOTO, NUM_CONTENTS } Content;
+static const char *content_names[NUM_CONTENTS] = { "flat", "gradient", "noise", "photo" };
+
+typedef struct {
+    int values[MAX_SWEEP];
+    int count;
+} Sweep;
+
+typedef struct {
+    double read, collect, build, quantize, write;
+    size_t unique_colors;
+} StageTimes;
+
+// Value noise: a bilinearly interpolated random lattice with the given cell size
+static double lattice_noise(int x, int y, int cell, uint32_t seed) {
+    int cx = x / cell, cy = y / cell;
+    double fx = (double)(x % cell) / cell, fy = (double)(y % cell) / cell;
+    double v00 = hash_key(seed ^ hash_key(cx * 73856093U ^ cy * 19349663U)) / 4294967295.0;
+    double v10 = hash_key(seed ^ hash_key((cx + 1) * 73856093U ^ cy * 19349663U)) / 4294967295.0;
+    double v01 = hash_key(seed ^ hash_key(cx * 73856093U ^ (cy + 1) * 19349663U)) / 4294967295.0;
+    double v11 = hash_key(seed ^ hash_key((cx + 1) * 73856093U ^ (cy + 1) * 19349663U)) / 4294967295.0;
+    double top = v00 + (v10 - v00) * fx;
+    double bottom = v01 + (v11 - v01) * fx;
+    return top + (bottom - top) * fy;
+}
+
+static int clamp255(double v) {
+    return v < 0 ? 0 : v > 255 ? 255 : (int)v;
+}
+
+static void synth_row(png_bytep row, Content content, int y, int w, int h) {
+    for (int x = 0; x < w; x++) {
+        png_bytep px = &row[x * 3];
+        uint32_t rnd = hash_key((uint32_t)y * 2654435761U ^ (uint32_t)x * 40503U);
+        switch (content) {
+        case CONTENT_FLAT: {
+            // 8x8 sprite cells drawn from a fixed 16-color palette
+            uint32_t c = hash_key((x / 8) * 131U ^ (y / 8) * 977U) & 15;
+            px[0] = (c * 53) & 0xFF;
+            px[1] = (c * 97) & 0xFF;
+            px[2] = (c * 29 + 40) & 0xFF;
+            break;
+        }
+        case CONTENT_GRADIENT:
+            px[0] = x * 255 / (w > 1 ? w - 1 : 1);
+            px[1] = y * 255 / (h > 1 ? h - 1 : 1);
+            px[2] = (px[0] + px[1]) / 2;
+            break;
+        case CONTENT_NOISE:
+            px[0] = rnd & 0xFF;
+            px[1] = (rnd >> 8) & 0xFF;
+            px[2] = (rnd >> 16) & 0xFF;
+            break;
+        case CONTENT_PHOTO: {
+            // Smooth multi-octave structure plus a little sensor-like grain
+            double base = 0.6 * lattice_noise(x, y, 97, 1) + 0.3 * lattice_noise(x, y, 23, 2)
+                        + 0.1 * lattice_noise(x, y, 5, 3);
+            double tint = lattice_noise(x, y, 151, 4);
+            double grain = ((int)(rnd & 15) - 8) * 0.8;
+            px[0] = clamp255(255 * base * (0.7 + 0.3 * tint) + grain);
+            px[1] = clamp255(255 * base * 0.85 + grain);
+            px[2] = clamp255(255 * base * (1.0 - 0.4 * tint) + grain);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+static void write_synthetic_png(const char *path, Content content, int w, int h) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open output file: %s\n", path);
+        die("open bench input");
+    }
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png_create_info_struct(png);
+    if (!png || !info) die("png write init");
+    png_init_io(png, fp);
+    png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    png_bytep row = malloc((size_t)w * 3);
+    if (!row) die("malloc bench row");
+    for (int y = 0; y < h; y++) {
+        synth_row(row, content, y, w, h);
+        png_write_row(png, row);
+    }
+    free(row);
+
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+    fclose(fp);
+}
+
+static void run_pipeline(const char *in_path, const char *out_path, const PaletteConfig *config, StageTimes *t) {
+    double t0 = wall_seconds();
+    int w, h, channels;
+    png_bytep *rows = read_png_image(in_path, &w, &h, &channels);
+    double t1 = wall_seconds();
+
+    ColorCounts all_colors;
+    collect_colors(rows, w, h, channels, config->bit_depth, &all_colors, 0);
+    t->unique_colors = all_colors.size;
+    double t2 = wall_seconds();
+
+    int palette_size;
+    Color *palette = build_palette(&all_colors, config, &palette_size);
+    color_counts_free(&all_colors);
+    double t3 = wall_seconds();
+
+    png_bytep *index_rows = quantize_image(rows, w, h, channels, config->bit_depth, palette, palette_size);
+    double t4 = wall_seconds();
+
+    convert_palette_depth(palette, palette_size, config->bit_depth, config->output_bit_depth);
+    write_palette_png(out_path, w, h, palette, palette_size, index_rows, config);
+    double t5 = wall_seconds();
+
+    free_rows(rows);
+    free_rows(index_rows);
+    free(palette);
+
+    t->read = t1 - t0;
+    t->collect = t2 - t1;
+    t->build = t3 - t2;
+    t->quantize = t4 - t3;
+    t->write = t5 - t4;
+}
+
+static double total_time(const StageTimes *t) {
+    return t->read + t->collect + t->build + t->quantize + t->write;
+}
+
+static void parse_sweep(const char *arg, Sweep *sweep, int lo, int hi, const char *name) {
+    sweep->count = 0;
+    const char *p = arg;
+    while (*p && sweep->count < MAX_SWEEP) {
+        int v = atoi(p);
+        if (v < lo || v > hi) {
+            fprintf(stderr, "expected %s values in [%d, %d] (got %d)\n", name, lo, hi, v);
+            exit(1);
+        }
+        sweep->values[sweep->count++] = v;
+        p = strchr(p, ',');
+        if (!p) break;
+        p++;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "options: \n"
+        "\t -sizes list (square edge lengths, default: 64,256,1024,4096; up to 16384) \n"
+        "\t -b list (logical bit depths, default: 5,8) \n"
+        "\t -n list (max_colors, default: 16,256) \n"
+        "\t -t list (thread counts, default: 1 and all available) \n"
+        "\t -r repeats (best of, default: 1) \n"
+        "\t -d dir (where synthetic inputs are written, default: .) \n"
+        "\t -o results.csv \n"
+        "\t -json results.json \n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    Sweep sizes = { { 64, 256, 1024, 4096 }, 4 };
+    Sweep depths = { { 5, 8 }, 2 };
+    Sweep colors = { { 16, 256 }, 2 };
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+#endif
+    Sweep threads = { { 1, max_threads }, max_threads > 1 ? 2 : 1 };
+    int repeats = 1;
+    const char *dir = ".";
+    const char *csv_path = NULL, *json_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-sizes") && i + 1 < argc) parse_sweep(argv[++i], &sizes, 1, 16384, "size");
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc) parse_sweep(argv[++i], &depths, 1, 8, "bit depth");
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc) parse_sweep(argv[++i], &colors, 2, 256, "max_colors");
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) parse_sweep(argv[++i], &threads, 1, 1024, "threads");
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc) repeats = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-d") && i + 1 < argc) dir = argv[++i];
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc) csv_path = argv[++i];
+        else if (!strcmp(argv[i], "-json") && i + 1 < argc) json_path = argv[++i];
+        else usage(argv[0]);
+    }
+    if (repeats < 1) repeats = 1;
+
+    FILE *csv = csv_path ? fopen(csv_path, "w") : stdout;
+    FILE *json = json_path ? fopen(json_path, "w") : NULL;
+    if (!csv || (json_path && !json)) die("open bench results");
+
+    fprintf(csv, "content,width,height,bit_depth,max_colors,threads,unique_colors,"
+                 "read_s,collect_s,build_s,quantize_s,write_s,total_s,mpix_per_s\n");
+    if (json) fprintf(json, "[\n");
+    int first_record = 1;
+
+    char in_path[4096], out_path[4096];
+    snprintf(out_path, sizeof(out_path), "%s/bench_out.png", dir);
+
+    for (int c = 0; c < NUM_CONTENTS; c++) {
+        for (int s = 0; s < sizes.count; s++) {
+            int size = sizes.values[s];
+            snprintf(in_path, sizeof(in_path), "%s/bench_%s_%d.png", dir, content_names[c], size);
+            write_synthetic_png(in_path, (Content)c, size, size);
+
+            for (int b = 0; b < depths.count; b++)
+            for (int n = 0; n < colors.count; n++)
+            for (int t = 0; t < threads.count; t++) {
+                PaletteConfig config = {
+                    .bit_depth = depths.values[b],
+                    .output_bit_depth = depths.values[b],
+                    .max_colors = colors.values[n],
+                    .skip = 0,
+                    .preselect = 1,
+                    .verbose = 0,
+                    .strip_rows = 0,
+                    .stats_path = NULL,
+                    .compression_level = Z_DEFAULT_COMPRESSION
+                };
+#ifdef _OPENMP
+                omp_set_num_threads(threads.values[t]);
+#endif
+                StageTimes best = { 0 };
+                for (int r = 0; r < repeats; r++) {
+                    StageTimes cur;
+                    run_pipeline(in_path, out_path, &config, &cur);
+                    if (r == 0 || total_time(&cur) < total_time(&best)) best = cur;
+                }
+
+                double total = total_time(&best);
+                double mpix = (double)size * size / 1e6;
+                fprintf(csv, "%s,%d,%d,%d,%d,%d,%zu,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f\n",
+                        content_names[c], size, size, config.bit_depth, config.max_colors,
+                        threads.values[t], best.unique_colors, best.read, best.collect, best.build,
+                        best.quantize, best.write, total, total > 0 ? mpix / total : 0.0);
+                fflush(csv);
+                if (json) {
+                    fprintf(json, "%s  {\"content\": \"%s\", \"width\": %d, \"height\": %d, \"bit_depth\": %d, "
+                                  "\"max_colors\": %d, \"threads\": %d, \"unique_colors\": %zu, "
+                                  "\"read_s\": %.6f, \"collect_s\": %.6f, \"build_s\": %.6f, "
+                                  "\"quantize_s\": %.6f, \"write_s\": %.6f, \"total_s\": %.6f}",
+                            first_record ? "" : ",\n", content_names[c], size, size, config.bit_depth,
+                            config.max_colors, threads.values[t], best.unique_colors, best.read,
+                            best.collect, best.build, best.quantize, best.write, total);
+                    first_record = 0;
+                }
+            }
+            remove(in_path);
+        }
+    }
+    remove(out_path);
+
+    if (json) {
+        fprintf(json, "\n]\n");
+        fclose(json);
+    }
+    if (csv != stdout) fclose(csv);
+    return 0;
+}
@@ -0,0 +1,318 @@
+#include "utils.h"
+
+// Cache files: a 32-byte header ("QCCH", version, bit depth, dither mode, flags, then 32-bit width, height,
+// channels, strip rows, sample rate and palette size), the palette as r, g, b bytes at the logical depth,
+// one (64-bit content hash, 32-bit color count) record per strip, each strip's histogram as (32-bit key,
+// 64-bit count) records, and the index rows. All fields are little-endian. Color counts are all 0 when
+// the run that wrote the file didn't count colors (-P).
+#define CACHE_MAGIC "QCCH"
+#define CACHE_VERSION 2
+#define CACHE_HAS_COLORS 1
+#define CACHE_STRATIFIED 2
+#define CACHE_HEADER_SIZE 32
+
+// Multiply-xorshift over 8-byte words. Not cryptographic; it only has to make a stale strip unlikely.
+static uint64_t hash_strip(png_bytep *rows, int n, size_t row_bytes) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ row_bytes;
+    for (int y = 0; y < n; y++) {
+        size_t i = 0;
+        uint64_t v;
+        for (; i + 8 <= row_bytes; i += 8) {
+            memcpy(&v, rows[y] + i, 8);
+            h = (h ^ v) * 0xff51afd7ed558ccdULL;
+            h ^= h >> 32;
+        }
+        v = 0;
+        memcpy(&v, rows[y] + i, row_bytes - i);
+        h = (h ^ v) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+static int strip_height(const StripCache *c, int s) {
+    int y0 = s * CACHE_STRIP_ROWS;
+    return c->h - y0 < CACHE_STRIP_ROWS ? c->h - y0 : CACHE_STRIP_ROWS;
+}
+
+static int has_all_colors(const StripCache *c) {
+    for (int s = 0; s < c->num_strips; s++)
+        if (!c->strip_colors[s].keys) return 0;
+    return 1;
+}
+
+// Records everything besides the pixels and the palette that a strip's histogram or index rows depend on
+static void cache_header(unsigned char *header, const StripCache *c, const PaletteConfig *config, int flags,
+                         int pal_size) {
+    Sampler sampler;
+    sampler_init(&sampler, config);
+    if (sampler.active && sampler.stratified) flags |= CACHE_STRATIFIED;
+    memcpy(header, CACHE_MAGIC, 4);
+    header[4] = CACHE_VERSION;
+    header[5] = (unsigned char)config->bit_depth;
+    header[6] = (unsigned char)config->dither;
+    header[7] = (unsigned char)flags;
+    put_le32(header + 8, c->w);
+    put_le32(header + 12, c->h);
+    put_le32(header + 16, c->channels);
+    put_le32(header + 20, CACHE_STRIP_ROWS);
+    put_le32(header + 24, sampler.rate);
+    put_le32(header + 28, pal_size);
+}
+
+// Returns 0, keeping nothing, when the file is missing, was written for another image or settings, or is corrupt
+static int cache_load(StripCache *c, const PaletteConfig *config) {
+    FILE *in = fopen(c->path, "rb");
+    if (!in) return 0;
+
+    unsigned char header[CACHE_HEADER_SIZE] = { 0 }, expected[CACHE_HEADER_SIZE];
+    int ok = fread(header, sizeof(header), 1, in) == 1;
+    int has_colors = header[7] & CACHE_HAS_COLORS;
+    cache_header(expected, c, config, has_colors, 0);
+    ok = ok && memcmp(header, expected, CACHE_HEADER_SIZE - 4) == 0;
+    uint32_t pal_size = ok ? get_le32(header + 28) : 0;
+    ok = ok && pal_size >= 1 && pal_size <= 256;
+
+    size_t table_size = 3 * (size_t)pal_size + 12 * (size_t)c->num_strips;
+    unsigned char *table = malloc(table_size);
+    c->palette = malloc(256 * sizeof(Color));
+    if (!table || !c->palette) die("malloc cache table");
+    ok = ok && fread(table, table_size, 1, in) == 1;
+    for (uint32_t i = 0; ok && i < pal_size; i++)
+        c->palette[i] = (Color){ table[3 * i], table[3 * i + 1], table[3 * i + 2] };
+    c->palette_size = pal_size;
+
+    uint64_t *old_hashes = malloc(c->num_strips * sizeof(uint64_t));
+    uint32_t *num_colors = malloc(c->num_strips * sizeof(uint32_t));
+    if (!old_hashes || !num_colors) die("malloc cache table");
+    uint64_t max_colors = (uint64_t)c->w * CACHE_STRIP_ROWS;
+    for (int s = 0; ok && s < c->num_strips; s++) {
+        const unsigned char *r = table + 3 * (size_t)pal_size + 12 * (size_t)s;
+        old_hashes[s] = get_le32(r) | ((uint64_t)get_le32(r + 4) << 32);
+        num_colors[s] = get_le32(r + 8);
+        ok = num_colors[s] <= max_colors && (has_colors || num_colors[s] == 0);
+    }
+
+    unsigned char *records = NULL;
+    for (int s = 0; ok && s < c->num_strips && has_colors; s++) {
+        size_t n = num_colors[s];
+        unsigned char *grown = realloc(records, 12 * n + 1);
+        if (!grown) die("malloc cache records");
+        records = grown;
+        ok = n == 0 || fread(records, 12 * n, 1, in) == 1;
+        // Changed strips get counted again; only their place in the file matters
+        if (!ok || old_hashes[s] != c->hashes[s]) continue;
+        ColorCounts *colors = &c->strip_colors[s];
+        color_counts_alloc(colors, n);
+        for (size_t i = 0; i < n; i++) {
+            colors->keys[i] = get_le32(records + 12 * i);
+            colors->counts[i] = get_le32(records + 12 * i + 4) | ((uint64_t)get_le32(records + 12 * i + 8) << 32);
+        }
+    }
+    free(records);
+
+    if (ok) {
+        c->indices = malloc((size_t)c->w * c->h);
+        if (!c->indices) die("malloc cached indices");
+        stats_count(&run_stats.bytes_allocated, (size_t)c->w * c->h);
+        ok = fread(c->indices, (size_t)c->w * c->h, 1, in) == 1;
+    }
+    for (int s = 0; ok && s < c->num_strips; s++) {
+        c->changed[s] = old_hashes[s] != c->hashes[s];
+        c->num_changed += c->changed[s];
+    }
+    if (!ok) {
+        for (int s = 0; s < c->num_strips; s++)
+            color_counts_free(&c->strip_colors[s]);
+        free(c->indices);
+        c->indices = NULL;
+        c->palette_size = 0;
+    }
+
+    free(old_hashes);
+    free(num_colors);
+    free(table);
+    fclose(in);
+    return ok;
+}
+
+// Hashes every strip of the decoded image and loads what the last run on `out_path` left, if it still applies
+void strip_cache_open(StripCache *c, const char *out_path, png_bytep *rows, int w, int h, int channels,
+                      const PaletteConfig *config) {
+    memset(c, 0, sizeof(*c));
+    size_t len = strlen(out_path);
+    c->path = malloc(len + sizeof(".qcache"));
+    if (!c->path) die("malloc cache path");
+    memcpy(c->path, out_path, len);
+    memcpy(c->path + len, ".qcache", sizeof(".qcache"));
+    c->w = w;
+    c->h = h;
+    c->channels = channels;
+    c->num_strips = (h + CACHE_STRIP_ROWS - 1) / CACHE_STRIP_ROWS;
+    c->hashes = malloc(c->num_strips * sizeof(uint64_t));
+    c->changed = malloc(c->num_strips);
+    c->strip_colors = calloc(c->num_strips, sizeof(ColorCounts));
+    if (!c->hashes || !c->changed || !c->strip_colors) die("malloc strip cache");
+
+    size_t row_bytes = (size_t)w * channels;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (int s = 0; s < c->num_strips; s++)
+        c->hashes[s] = hash_strip(&rows[s * CACHE_STRIP_ROWS], strip_height(c, s), row_bytes);
+
+    c->loaded = cache_load(c, config);
+    if (!c->loaded) {
+        memset(c->changed, 1, c->num_strips);
+        c->num_changed = c->num_strips;
+    }
+    if (config->verbose) {
+        if (c->loaded)
+            fprintf(stderr, "cache: %d of %d strips changed\n", c->num_changed, c->num_strips);
+        else
+            fprintf(stderr, "cache: nothing usable in %s, processing all %d strips\n", c->path, c->num_strips);
+    }
+}
+
+// Counts the strips without cached colors, one strip per thread, then sums every strip's colors
+void strip_cache_colors(StripCache *c, Workspace *ws, png_bytep *rows, const Sampler *sampler, ColorCounts *out) {
+    int *todo = malloc(c->num_strips * sizeof(int));
+    if (!todo) die("malloc cache strips");
+    int num_todo = 0;
+    for (int s = 0; s < c->num_strips; s++)
+        if (!c->strip_colors[s].keys) todo[num_todo++] = s;
+    int sampled = sampler && sampler->active;
+
+#ifdef _OPENMP
+    #pragma omp parallel if (num_todo > 1)
+#endif
+    {
+        ColorHistogram local;
+        histogram_init(&local, ws->hist.bit_depth, 1);
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 1)
+#endif
+        for (int k = 0; k < num_todo; k++) {
+            int s = todo[k];
+            int y0 = s * CACHE_STRIP_ROWS;
+            histogram_reset(&local);
+            if (sampled)
+                histogram_add_sampled_rows(&local, &rows[y0], c->w, strip_height(c, s), c->channels, y0, c->h, sampler);
+            else
+                histogram_add_rows(&local, &rows[y0], c->w, strip_height(c, s), c->channels);
+            histogram_colors(&local, &c->strip_colors[s]);
+        }
+        histogram_free(&local);
+    }
+    free(todo);
+
+    histogram_reset(&ws->hist);
+    for (int s = 0; s < c->num_strips; s++)
+        histogram_add_colors(&ws->hist, &c->strip_colors[s]);
+    histogram_colors(&ws->hist, out);
+    stats_count(&run_stats.unique_colors, out->size);
+}
+
+// With the same palette, unchanged strips take their cached index rows and only changed ones are remapped
+void strip_cache_remap(StripCache *c, png_bytep *rows, png_bytep *index_rows, const Color *palette, int pal_size,
+                       const PaletteConfig *config) {
+    int same_palette = c->loaded && pal_size == c->palette_size
+                    && memcmp(palette, c->palette, pal_size * sizeof(Color)) == 0;
+    // Floyd-Steinberg carries error down across strip boundaries, so any change there redoes every strip
+    int reuse = same_palette && (config->dither != DITHER_FLOYD_STEINBERG || c->num_changed == 0);
+
+    png_bytep *src = rows, *dst = index_rows;
+    int n = c->h;
+    if (reuse) {
+        // Changed strips are remapped as one batch. Strips start on multiples of 8 rows, so ordered
+        // dithering still sees each row at its own phase of the 8x8 pattern.
+        src = malloc(c->h * sizeof(png_bytep));
+        dst = malloc(c->h * sizeof(png_bytep));
+        if (!src || !dst) die("malloc changed rows");
+        n = 0;
+        for (int s = 0; s < c->num_strips; s++) {
+            if (!c->changed[s]) continue;
+            for (int y = s * CACHE_STRIP_ROWS; y < s * CACHE_STRIP_ROWS + strip_height(c, s); y++) {
+                src[n] = rows[y];
+                dst[n++] = index_rows[y];
+            }
+        }
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for (int s = 0; s < c->num_strips; s++) {
+            if (c->changed[s]) continue;
+            for (int y = s * CACHE_STRIP_ROWS; y < s * CACHE_STRIP_ROWS + strip_height(c, s); y++)
+                memcpy(index_rows[y], c->indices + (size_t)y * c->w, c->w);
+        }
+        stats_count(&run_stats.reused_strips, c->num_strips - c->num_changed);
+    }
+
+    if (n > 0) {
+        InverseColormap map;
+        inverse_colormap_init(&map, config->bit_depth, palette, pal_size, (size_t)c->w * n);
+        Dither dither;
+        dither_init(&dither, &map, config->dither, c->w);
+        dither_rows(&dither, &map, src, dst, n, c->channels);
+        dither_free(&dither);
+        inverse_colormap_free(&map);
+    }
+    if (reuse) {
+        free(src);
+        free(dst);
+    }
+
+    if (config->verbose) {
+        fprintf(stderr, "cache: palette %s, reused %d of %d index strips\n", same_palette ? "unchanged" : "changed",
+                reuse ? c->num_strips - c->num_changed : 0, c->num_strips);
+    }
+}
+
+// `palette` is at the logical depth, as strip_cache_remap compares it
+void strip_cache_save(StripCache *c, png_bytep *index_rows, const Color *palette, int pal_size,
+                      const PaletteConfig *config) {
+    char *tmp_path;
+    FILE *out = replace_open(c->path, &tmp_path);
+    int has_colors = has_all_colors(c);
+
+    unsigned char header[CACHE_HEADER_SIZE];
+    cache_header(header, c, config, has_colors ? CACHE_HAS_COLORS : 0, pal_size);
+    int ok = fwrite(header, sizeof(header), 1, out) == 1;
+
+    for (int i = 0; ok && i < pal_size; i++) {
+        unsigned char rgb[3] = { (unsigned char)palette[i].r, (unsigned char)palette[i].g, (unsigned char)palette[i].b };
+        ok = fwrite(rgb, sizeof(rgb), 1, out) == 1;
+    }
+    for (int s = 0; ok && s < c->num_strips; s++) {
+        unsigned char record[12];
+        put_le32(record, (uint32_t)c->hashes[s]);
+        put_le32(record + 4, (uint32_t)(c->hashes[s] >> 32));
+        put_le32(record + 8, has_colors ? (uint32_t)c->strip_colors[s].size : 0);
+        ok = fwrite(record, sizeof(record), 1, out) == 1;
+    }
+    for (int s = 0; ok && has_colors && s < c->num_strips; s++) {
+        const ColorCounts *colors = &c->strip_colors[s];
+        for (size_t i = 0; ok && i < colors->size; i++) {
+            unsigned char record[12];
+            put_le32(record, colors->keys[i]);
+            put_le32(record + 4, (uint32_t)colors->counts[i]);
+            put_le32(record + 8, (uint32_t)(colors->counts[i] >> 32));
+            ok = fwrite(record, sizeof(record), 1, out) == 1;
+        }
+    }
+    for (int y = 0; ok && y < c->h; y++)
+        ok = fwrite(index_rows[y], c->w, 1, out) == 1;
+    replace_commit(out, tmp_path, c->path, ok);
+}
+
+void strip_cache_free(StripCache *c) {
+    for (int s = 0; s < c->num_strips; s++)
+        color_counts_free(&c->strip_colors[s]);
+    free(c->strip_colors);
+    free(c->hashes);
+    free(c->changed);
+    free(c->palette);
+    free(c->indices);
+    free(c->path);
+}
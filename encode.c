@@ -0,0 +1,272 @@
+#include "utils.h"
+
+// Filtered bytes per independently deflated strip; fixed so the output doesn't depend on the thread count
+#define ENCODE_STRIP_BYTES (256 * 1024)
+#define DEFLATE_WINDOW 32768
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    uLong adler;
+} EncodedStrip;
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+static void write_chunk(PngSink *sink, const char *type, const unsigned char *data, size_t size) {
+    unsigned char header[8];
+    put_be32(header, (uint32_t)size);
+    memcpy(header + 4, type, 4);
+    uLong crc = crc32(0L, (const Bytef*)type, 4);
+    if (size) crc = crc32(crc, data, (uInt)size);
+    unsigned char trailer[4];
+    put_be32(trailer, (uint32_t)crc);
+
+    png_sink_write(sink, header, 8);
+    png_sink_write(sink, data, size);
+    png_sink_write(sink, trailer, 4);
+}
+
+static inline int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// Writes the filter type byte plus the filtered row to `out`; `prev` is NULL for the first row
+static void filter_row(int type, png_const_bytep row, png_const_bytep prev, size_t n, png_bytep out) {
+    out[0] = (png_byte)type;
+    png_bytep f = out + 1;
+    for (size_t i = 0; i < n; i++) {
+        int a = i ? row[i - 1] : 0;
+        int b = prev ? prev[i] : 0;
+        int c = i && prev ? prev[i - 1] : 0;
+        switch (type) {
+        case PNG_FILTER_VALUE_SUB:   f[i] = row[i] - a; break;
+        case PNG_FILTER_VALUE_UP:    f[i] = row[i] - b; break;
+        case PNG_FILTER_VALUE_AVG:   f[i] = row[i] - ((a + b) >> 1); break;
+        case PNG_FILTER_VALUE_PAETH: f[i] = row[i] - paeth(a, b, c); break;
+        default:                     f[i] = row[i]; break;
+        }
+    }
+}
+
+// Minimum sum of absolute differences, the heuristic libpng uses for PNG_ALL_FILTERS
+static void filter_row_adaptive(png_const_bytep row, png_const_bytep prev, size_t n, png_bytep out, png_bytep trial) {
+    unsigned long best_sum = (unsigned long)-1;
+    for (int type = PNG_FILTER_VALUE_NONE; type <= PNG_FILTER_VALUE_PAETH; type++) {
+        filter_row(type, row, prev, n, trial);
+        unsigned long sum = 0;
+        for (size_t i = 1; i <= n; i++)
+            sum += trial[i] < 128 ? trial[i] : 256 - trial[i];
+        if (sum < best_sum) {
+            best_sum = sum;
+            memcpy(out, trial, n + 1);
+        }
+    }
+}
+
+// zlib's FLEVEL hint in the stream header, matching what deflateInit would write for the level
+static unsigned char zlib_header_flags(int level) {
+    int flevel = level == Z_DEFAULT_COMPRESSION ? 2 : level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    unsigned char flg = flevel << 6;
+    return flg + 31 - ((0x78 * 256 + flg) % 31);
+}
+
+// Runs inside a parallel region, so failures are returned (-1, with strip->data NULL) rather than dying
+static int deflate_strip(EncodedStrip *strip, png_const_bytep filtered, size_t start, size_t size, int last, int level) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    strip->data = NULL;
+    // Raw deflate; the zlib header and the combined Adler-32 are written around the joined strips
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+
+    // Priming with the preceding window keeps cross-strip matches; the decoder sees it as one continuous stream
+    if (start > 0) {
+        size_t dict = start < DEFLATE_WINDOW ? start : DEFLATE_WINDOW;
+        deflateSetDictionary(&zs, filtered + start - dict, (uInt)dict);
+    }
+
+    size_t cap = deflateBound(&zs, size) + 16;
+    strip->data = malloc(cap);
+    if (!strip->data) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_in = (Bytef*)filtered + start;
+    zs.avail_in = (uInt)size;
+    zs.next_out = strip->data;
+    zs.avail_out = (uInt)cap;
+    // A sync flush ends on a byte boundary without marking the last block, so strips concatenate
+    int ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    deflateEnd(&zs);
+    if (ret != (last ? Z_STREAM_END : Z_OK) || zs.avail_in != 0) {
+        free(strip->data);
+        strip->data = NULL;
+        return -1;
+    }
+    strip->size = cap - zs.avail_out;
+    strip->adler = adler32(1L, filtered + start, (uInt)size);
+    return 0;
+}
+
+int png_index_bit_depth(int pal_size) {
+    if (pal_size <= 2) return 1;
+    if (pal_size <= 4) return 2;
+    if (pal_size <= 16) return 4;
+    return 8;
+}
+
+// Filters rows and deflates fixed-size strips of them in parallel, then joins the strips into one IDAT stream
+void encode_palette_png(PngSink *sink, int w, int h, Color *palette, int pal_size,
+                        png_bytep *index_rows, const PaletteConfig *config) {
+    if (pal_size > 256) {
+        fprintf(stderr, "an indexed PNG holds at most 256 colors (got %d)\n", pal_size);
+        die("encode palette png");
+    }
+    int bit_depth = png_index_bit_depth(pal_size);
+    size_t row_bytes = ((size_t)w * bit_depth + 7) / 8;
+    size_t stride = row_bytes + 1;
+
+    png_bytep *rows = index_rows;
+    png_bytep *packed = NULL;
+    if (bit_depth < 8) {
+        packed = alloc_rows(h, row_bytes);
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, DYNAMIC_CHUNK_SIZE)
+#endif
+        for (int y = 0; y < h; y++)
+            pack_row(index_rows[y], packed[y], w, bit_depth);
+        rows = packed;
+    }
+
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+#endif
+    // Adaptive filtering tries every filter in a scratch row per thread
+    png_bytep filtered = malloc((size_t)h * stride);
+    png_bytep trials = config->png_filter == FILTER_ADAPTIVE ? malloc((size_t)max_threads * stride) : NULL;
+    if (!filtered || (config->png_filter == FILTER_ADAPTIVE && !trials)) {
+        free(filtered);
+        free(trials);
+        if (packed) free_rows(packed);
+        die("malloc filtered rows");
+    }
+    stats_count(&run_stats.bytes_allocated, (size_t)h * stride);
+
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+#ifdef _OPENMP
+        png_bytep trial = trials ? trials + (size_t)omp_get_thread_num() * stride : NULL;
+#else
+        png_bytep trial = trials;
+#endif
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, DYNAMIC_CHUNK_SIZE)
+#endif
+        for (int y = 0; y < h; y++) {
+            png_const_bytep prev = y ? rows[y - 1] : NULL;
+            if (config->png_filter == FILTER_ADAPTIVE)
+                filter_row_adaptive(rows[y], prev, row_bytes, filtered + y * stride, trial);
+            else
+                filter_row(config->png_filter, rows[y], prev, row_bytes, filtered + y * stride);
+        }
+    }
+    free(trials);
+    if (packed) free_rows(packed);
+
+    int strip_rows = ENCODE_STRIP_BYTES / stride;
+    if (strip_rows < 1) strip_rows = 1;
+    int num_strips = (h + strip_rows - 1) / strip_rows;
+    EncodedStrip *strips = malloc(num_strips * sizeof(EncodedStrip));
+    if (!strips) {
+        free(filtered);
+        die("malloc encoded strips");
+    }
+
+    int failed = 0;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1) reduction(|:failed)
+#endif
+    for (int s = 0; s < num_strips; s++) {
+        size_t first = (size_t)s * strip_rows;
+        size_t n = h - first < (size_t)strip_rows ? h - first : (size_t)strip_rows;
+        failed |= deflate_strip(&strips[s], filtered, first * stride, n * stride, s == num_strips - 1,
+                                config->compression_level) != 0;
+    }
+    if (failed) {
+        for (int s = 0; s < num_strips; s++)
+            free(strips[s].data);
+        free(strips);
+        free(filtered);
+        die("deflate");
+    }
+
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    png_sink_write(sink, signature, 8);
+
+    unsigned char ihdr[13];
+    put_be32(ihdr, w);
+    put_be32(ihdr + 4, h);
+    ihdr[8] = bit_depth;
+    ihdr[9] = PNG_COLOR_TYPE_PALETTE;
+    ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+    ihdr[11] = PNG_FILTER_TYPE_BASE;
+    ihdr[12] = PNG_INTERLACE_NONE;
+    write_chunk(sink, "IHDR", ihdr, sizeof(ihdr));
+
+    unsigned char plte[3 * 256];
+    for (int i = 0; i < pal_size; i++) {
+        plte[3 * i] = palette[i].r;
+        plte[3 * i + 1] = palette[i].g;
+        plte[3 * i + 2] = palette[i].b;
+    }
+    write_chunk(sink, "PLTE", plte, 3 * pal_size);
+
+    // One IDAT per strip: the first carries the zlib header, the last the Adler-32 of all filtered bytes
+    uLong adler = 1L;
+    for (int s = 0; s < num_strips; s++) {
+        size_t first = (size_t)s * strip_rows;
+        size_t n = h - first < (size_t)strip_rows ? h - first : (size_t)strip_rows;
+        adler = adler32_combine(adler, strips[s].adler, (z_off_t)(n * stride));
+    }
+
+    for (int s = 0; s < num_strips; s++) {
+        size_t extra = (s == 0 ? 2 : 0) + (s == num_strips - 1 ? 4 : 0);
+        unsigned char *chunk = malloc(strips[s].size + extra);
+        if (!chunk) die("malloc idat");
+        unsigned char *p = chunk;
+        if (s == 0) {
+            *p++ = 0x78;
+            *p++ = zlib_header_flags(config->compression_level);
+        }
+        memcpy(p, strips[s].data, strips[s].size);
+        p += strips[s].size;
+        if (s == num_strips - 1) put_be32(p, (uint32_t)adler);
+        write_chunk(sink, "IDAT", chunk, strips[s].size + extra);
+        free(chunk);
+        free(strips[s].data);
+    }
+    write_chunk(sink, "IEND", NULL, 0);
+
+    free(strips);
+    free(filtered);
+}
+
+// "-" writes to stdout
+void write_palette_png(const char *path, int w, int h, Color *palette, int pal_size,
+                       png_bytep *index_rows, const PaletteConfig *config) {
+    PngSink sink;
+    png_sink_open(&sink, path);
+    encode_palette_png(&sink, w, h, palette, pal_size, index_rows, config);
+    png_sink_close(&sink);
+}
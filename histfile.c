@@ -0,0 +1,109 @@
+#include "utils.h"
+
+// Saved histograms: an 8-byte header ("QHST", version, bit depth, two zero bytes), a 64-bit color count,
+// then one record per color: a 32-bit packed 0xRRGGBB key and a 64-bit count. All fields are little-endian.
+#define HISTFILE_MAGIC "QHST"
+#define HISTFILE_VERSION 2
+
+void put_le32(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = v >> 24;
+}
+
+uint32_t get_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Writes go next to the target and are renamed over it by replace_commit, so an interrupted run
+// never leaves a truncated file behind
+FILE* replace_open(const char *path, char **tmp_path) {
+    size_t len = strlen(path);
+    *tmp_path = malloc(len + 5);
+    if (!*tmp_path) die("malloc temporary path");
+    memcpy(*tmp_path, path, len);
+    memcpy(*tmp_path + len, ".tmp", 5);
+
+    FILE *out = fopen(*tmp_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Failed to write to file: %s\n", *tmp_path);
+        die("write file");
+    }
+    return out;
+}
+
+// `ok` is whether every write succeeded
+void replace_commit(FILE *out, char *tmp_path, const char *path, int ok) {
+    if (fclose(out) != 0 || !ok || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Failed to write to file: %s\n", path);
+        die("write file");
+    }
+    free(tmp_path);
+}
+
+void histogram_save(const char *path, const ColorCounts *colors, int bit_depth) {
+    size_t n = colors->size;
+    char *tmp_path;
+    FILE *out = replace_open(path, &tmp_path);
+
+    unsigned char header[16] = { 'Q', 'H', 'S', 'T', HISTFILE_VERSION, (unsigned char)bit_depth, 0, 0 };
+    put_le32(header + 8, (uint32_t)n);
+    put_le32(header + 12, (uint32_t)((uint64_t)n >> 32));
+    int ok = fwrite(header, sizeof(header), 1, out) == 1;
+
+    unsigned char record[12];
+    for (size_t i = 0; ok && i < n; i++) {
+        put_le32(record, colors->keys[i]);
+        put_le32(record + 4, (uint32_t)colors->counts[i]);
+        put_le32(record + 8, (uint32_t)(colors->counts[i] >> 32));
+        ok = fwrite(record, sizeof(record), 1, out) == 1;
+    }
+    replace_commit(out, tmp_path, path, ok);
+}
+
+// Leaves `out` empty when `path` does not exist yet
+void histogram_load(const char *path, int bit_depth, ColorCounts *out) {
+    *out = (ColorCounts){ NULL, NULL, 0 };
+    FILE *in = fopen(path, "rb");
+    if (!in) return;
+
+    unsigned char header[16];
+    if (fread(header, sizeof(header), 1, in) != 1 || memcmp(header, HISTFILE_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s: not a saved histogram\n", path);
+        exit(1);
+    }
+    if (header[4] != HISTFILE_VERSION) {
+        fprintf(stderr, "%s: unsupported histogram version %d\n", path, header[4]);
+        exit(1);
+    }
+    if (header[5] != bit_depth) {
+        fprintf(stderr, "%s: histogram was collected at bit depth %d, not %d\n", path, header[5], bit_depth);
+        exit(1);
+    }
+
+    uint64_t n = get_le32(header + 8) | ((uint64_t)get_le32(header + 12) << 32);
+    if (n > ((uint64_t)1 << (3 * bit_depth))) {
+        fprintf(stderr, "%s: corrupt histogram (%llu colors)\n", path, (unsigned long long)n);
+        exit(1);
+    }
+
+    color_counts_alloc(out, n);
+
+    uint32_t max_value = (1U << bit_depth) - 1;
+    unsigned char record[12];
+    for (uint64_t i = 0; i < n; i++) {
+        if (fread(record, sizeof(record), 1, in) != 1) {
+            fprintf(stderr, "%s: truncated histogram\n", path);
+            exit(1);
+        }
+        uint32_t key = get_le32(record);
+        out->keys[i] = key;
+        out->counts[i] = get_le32(record + 4) | (uint64_t)get_le32(record + 8) << 32;
+        if ((key >> 16) > max_value || ((key >> 8) & 0xFF) > max_value || (key & 0xFF) > max_value) {
+            fprintf(stderr, "%s: corrupt histogram (color %llu out of range)\n", path, (unsigned long long)i);
+            exit(1);
+        }
+    }
+    fclose(in);
+}
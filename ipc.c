@@ -0,0 +1,73 @@
+#define _POSIX_C_SOURCE 200809L
+#include "utils.h"
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void socket_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr->sun_path, path);
+}
+
+// Replaces a stale socket left by a previous run. The socket is created owner-only: a request can name
+// any file the daemon can read, so other local users must not be able to connect.
+int unix_socket_listen(const char *path) {
+    struct sockaddr_un addr;
+    socket_address(&addr, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) die("socket");
+    unlink(path);
+    mode_t old_mask = umask(0177);
+    int bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound != 0) {
+        fprintf(stderr, "Failed to bind socket: %s\n", path);
+        die("bind");
+    }
+    if (listen(fd, DAEMON_BACKLOG) != 0) die("listen");
+    return fd;
+}
+
+int unix_socket_connect(const char *path) {
+    struct sockaddr_un addr;
+    socket_address(&addr, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) die("socket");
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Failed to connect to daemon: %s\n", path);
+        die("connect");
+    }
+    return fd;
+}
+
+// Both return 0 once all n bytes moved, -1 on error or when the peer closed first
+int read_full(int fd, void *buf, size_t n) {
+    unsigned char *p = buf;
+    while (n > 0) {
+        ssize_t got = read(fd, p, n);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return -1;
+        p += got;
+        n -= got;
+    }
+    return 0;
+}
+
+int write_full(int fd, const void *buf, size_t n) {
+    const unsigned char *p = buf;
+    while (n > 0) {
+        ssize_t put = write(fd, p, n);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return -1;
+        p += put;
+        n -= put;
+    }
+    return 0;
+}
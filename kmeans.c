@@ -0,0 +1,134 @@
+#include "utils.h"
+
+// Weighted sums of the colors assigned to one palette entry
+typedef struct {
+    uint64_t r, g, b, weight;
+} ClusterSum;
+
+// Assigns every histogram color to its nearest entry, the same search remapping uses, and accumulates
+// each entry's weighted sums. Returns the total weighted distance. Sums are integers, so the result
+// doesn't depend on the thread count.
+static uint64_t assign_colors(const PaletteSoA *soa, const ColorCounts *colors, ClusterSum *sums,
+                              ClusterSum *thread_sums) {
+    size_t n = colors->size;
+    int pal_size = (int)soa->size;
+    uint64_t total = 0;
+    memset(sums, 0, pal_size * sizeof(ClusterSum));
+
+#ifdef _OPENMP
+    #pragma omp parallel if (n >= PARALLEL_SCAN_MIN_COLORS) reduction(+:total)
+#endif
+    {
+#ifdef _OPENMP
+        ClusterSum *local = &thread_sums[(size_t)omp_get_thread_num() * pal_size];
+#else
+        ClusterSum *local = thread_sums;
+#endif
+        memset(local, 0, pal_size * sizeof(ClusterSum));
+
+#ifdef _OPENMP
+        #pragma omp for schedule(static)
+#endif
+        for (size_t i = 0; i < n; i++) {
+            uint32_t key = colors->keys[i];
+            int r = key >> 16, g = (key >> 8) & 0xFF, b = key & 0xFF;
+            uint64_t count = colors->counts[i];
+            int dist;
+            int k = soa->kernels->nearest(soa, r, g, b, &dist);
+            local[k].r += r * count;
+            local[k].g += g * count;
+            local[k].b += b * count;
+            local[k].weight += count;
+            total += dist * count;
+        }
+
+#ifdef _OPENMP
+        #pragma omp critical(kmeans_merge)
+#endif
+        for (int k = 0; k < pal_size; k++) {
+            sums[k].r += local[k].r;
+            sums[k].g += local[k].g;
+            sums[k].b += local[k].b;
+            sums[k].weight += local[k].weight;
+        }
+    }
+    stats_count(&run_stats.distance_evals, (uint64_t)n * pal_size);
+    return total;
+}
+
+// Weighted Lloyd iterations over the histogram: each entry moves to the mean of the colors nearest to it,
+// so the cost follows the number of unique colors rather than the pixel count. The -s slots stay put.
+// The distance isn't squared Euclidean, so a mean step can make things worse; the palette with the lowest
+// error is kept, and the loop ends when an iteration gains less than kmeans_threshold of the error.
+void refine_palette(Color *palette, int pal_size, const ColorCounts *colors, const PaletteConfig *config) {
+    int first = config->skip < pal_size ? config->skip : pal_size;
+    if (pal_size - first < 1 || colors->size == 0) return;
+
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+#endif
+    ClusterSum *sums = malloc(pal_size * sizeof(ClusterSum));
+    ClusterSum *thread_sums = malloc((size_t)max_threads * pal_size * sizeof(ClusterSum));
+    Color *best = malloc(pal_size * sizeof(Color));
+    if (!sums || !thread_sums || !best) {
+        free(sums);
+        free(thread_sums);
+        free(best);
+        die("malloc k-means state");
+    }
+
+    uint64_t pixels = 0;
+    for (size_t i = 0; i < colors->size; i++)
+        pixels += colors->counts[i];
+
+    PaletteSoA soa;
+    palette_soa_init(&soa, palette, pal_size);
+    double t0 = wall_seconds();
+    uint64_t best_error = assign_colors(&soa, colors, sums, thread_sums);
+    palette_soa_free(&soa);
+    memcpy(best, palette, pal_size * sizeof(Color));
+    if (config->verbose) {
+        fprintf(stderr, "k-means %2d: mean error %.4f, %.3f ms (greedy palette)\n", 0,
+                (double)best_error / pixels, (wall_seconds() - t0) * 1e3);
+    }
+
+    for (int it = 1; it <= config->kmeans_iterations; it++) {
+        t0 = wall_seconds();
+        // Entries nothing maps to keep their color
+        int moved = 0;
+        for (int k = first; k < pal_size; k++) {
+            if (!sums[k].weight) continue;
+            uint64_t half = sums[k].weight / 2;
+            Color mean = { (int)((sums[k].r + half) / sums[k].weight), (int)((sums[k].g + half) / sums[k].weight),
+                           (int)((sums[k].b + half) / sums[k].weight) };
+            if (mean.r != palette[k].r || mean.g != palette[k].g || mean.b != palette[k].b) moved++;
+            palette[k] = mean;
+        }
+        if (!moved) {
+            if (config->verbose) fprintf(stderr, "k-means %2d: converged, no entry moved\n", it);
+            break;
+        }
+
+        palette_soa_init(&soa, palette, pal_size);
+        uint64_t error = assign_colors(&soa, colors, sums, thread_sums);
+        palette_soa_free(&soa);
+        stats_count(&run_stats.kmeans_iterations, 1);
+        if (config->verbose) {
+            fprintf(stderr, "k-means %2d: mean error %.4f, %d entries moved, %.3f ms\n", it,
+                    (double)error / pixels, moved, (wall_seconds() - t0) * 1e3);
+        }
+
+        if (error >= best_error) break;
+        double gain = (double)(best_error - error) / best_error;
+        best_error = error;
+        memcpy(best, palette, pal_size * sizeof(Color));
+        if (gain < config->kmeans_threshold) break;
+    }
+
+    memcpy(palette, best, pal_size * sizeof(Color));
+    free(best);
+    free(sums);
+    free(thread_sums);
+}
@@ -0,0 +1,170 @@
+#include "libquantize.h"
+#include "utils.h"
+#include <setjmp.h>
+
+struct lq_context {
+    int num_threads;
+    Workspace ws;
+    int ws_bit_depth;
+    png_bytep *in_rows;
+    png_bytep *out_rows;
+    int rows_cap;
+    // Intermediate state of the call in progress, here rather than on the stack so the error path can free it
+    ColorCounts colors;
+    Color *selected;
+    InverseColormap map;
+};
+
+static void release_call_state(lq_context *ctx) {
+    color_counts_free(&ctx->colors);
+    free(ctx->selected);
+    ctx->selected = NULL;
+    inverse_colormap_free(&ctx->map);
+}
+
+void lq_default_options(lq_options *opt) {
+    opt->bit_depth = 8;
+    opt->output_bit_depth = 8;
+    opt->max_colors = 256;
+    opt->skip = 0;
+    opt->preselect = 1;
+}
+
+lq_context* lq_create(int num_threads) {
+    lq_context *ctx = calloc(1, sizeof(lq_context));
+    if (!ctx) return NULL;
+#ifdef _OPENMP
+    ctx->num_threads = num_threads > 0 ? num_threads : omp_get_max_threads();
+#else
+    (void)num_threads;
+    ctx->num_threads = 1;
+#endif
+    return ctx;
+}
+
+void lq_destroy(lq_context *ctx) {
+    if (!ctx) return;
+    if (ctx->ws_bit_depth) workspace_free(&ctx->ws);
+    free(ctx->in_rows);
+    free(ctx->out_rows);
+    free(ctx);
+}
+
+static lq_error check_arguments(const lq_options *opt, const unsigned char *pixels, int w, int h,
+                                int channels, size_t stride, const unsigned char *indices,
+                                size_t index_stride, const lq_color *palette, const int *pal_size) {
+    if (!opt || !pixels || !indices || !palette || !pal_size) return LQ_ERROR_INVALID_ARGUMENT;
+    if (w < 1 || h < 1 || (channels != 3 && channels != 4)) return LQ_ERROR_INVALID_ARGUMENT;
+    if (stride < (size_t)w * channels || index_stride < (size_t)w) return LQ_ERROR_INVALID_ARGUMENT;
+    if (opt->bit_depth < 1 || opt->bit_depth > 8) return LQ_ERROR_INVALID_ARGUMENT;
+    if (opt->output_bit_depth < opt->bit_depth || opt->output_bit_depth > 8) return LQ_ERROR_INVALID_ARGUMENT;
+    if (opt->max_colors < 1 || opt->max_colors > 256) return LQ_ERROR_INVALID_ARGUMENT;
+    if (opt->skip < 0 || opt->max_colors - opt->skip < 1 || opt->preselect < 0) return LQ_ERROR_INVALID_ARGUMENT;
+    return LQ_OK;
+}
+
+static lq_error reserve_row_pointers(lq_context *ctx, int h) {
+    if (h <= ctx->rows_cap) return LQ_OK;
+    png_bytep *in_rows = realloc(ctx->in_rows, h * sizeof(png_bytep));
+    if (in_rows) ctx->in_rows = in_rows;
+    png_bytep *out_rows = realloc(ctx->out_rows, h * sizeof(png_bytep));
+    if (out_rows) ctx->out_rows = out_rows;
+    if (!in_rows || !out_rows) return LQ_ERROR_OUT_OF_MEMORY;
+    ctx->rows_cap = h;
+    return LQ_OK;
+}
+
+lq_error lq_quantize(lq_context *ctx, const lq_options *opt,
+                     const unsigned char *pixels, int w, int h, int channels, size_t stride,
+                     unsigned char *indices, size_t index_stride,
+                     lq_color *palette, int *pal_size) {
+    if (!ctx) return LQ_ERROR_INVALID_ARGUMENT;
+    lq_error err = check_arguments(opt, pixels, w, h, channels, stride, indices, index_stride, palette, pal_size);
+    if (err != LQ_OK) return err;
+    if ((err = reserve_row_pointers(ctx, h)) != LQ_OK) return err;
+
+    // The histogram tables are kept for the context's lifetime and only rebuilt when the depth changes
+    if (ctx->ws_bit_depth != opt->bit_depth) {
+        if (ctx->ws_bit_depth) workspace_free(&ctx->ws);
+        ctx->ws_bit_depth = 0;
+    }
+
+    PaletteConfig config = {
+        .bit_depth = opt->bit_depth,
+        .output_bit_depth = opt->output_bit_depth,
+        .max_colors = opt->max_colors,
+        .skip = opt->skip,
+        .preselect = opt->preselect,
+        .verbose = 0,
+        .strip_rows = 0,
+        .stats_path = NULL,
+        .compression_level = Z_DEFAULT_COMPRESSION
+    };
+
+#ifdef _OPENMP
+    int saved_threads = omp_get_max_threads();
+    omp_set_num_threads(ctx->num_threads);
+#endif
+
+    // Allocation failures deep in the pipeline come back here instead of exiting the process. Stages report
+    // them from the calling thread, outside their parallel regions, so the jump never leaves an OpenMP region.
+    memset(&ctx->colors, 0, sizeof(ctx->colors));
+    memset(&ctx->map, 0, sizeof(ctx->map));
+    ctx->selected = NULL;
+    jmp_buf on_error;
+    if (setjmp(on_error)) {
+        set_die_handler(NULL);
+        release_call_state(ctx);
+        // A failed allocation can leave the tables half-grown, so start from scratch next time
+        if (ctx->ws_bit_depth) workspace_free(&ctx->ws);
+        ctx->ws_bit_depth = 0;
+#ifdef _OPENMP
+        omp_set_num_threads(saved_threads);
+#endif
+        return LQ_ERROR_OUT_OF_MEMORY;
+    }
+    set_die_handler(&on_error);
+
+    if (!ctx->ws_bit_depth) {
+        workspace_init(&ctx->ws, opt->bit_depth, ctx->num_threads);
+        ctx->ws_bit_depth = opt->bit_depth;
+    }
+
+    for (int y = 0; y < h; y++) {
+        ctx->in_rows[y] = (png_bytep)pixels + y * stride;
+        ctx->out_rows[y] = indices + y * index_stride;
+    }
+
+    workspace_collect_colors(&ctx->ws, ctx->in_rows, w, h, channels, NULL, &ctx->colors);
+
+    int palette_size;
+    ctx->selected = build_palette(&ctx->colors, &config, &palette_size);
+    color_counts_free(&ctx->colors);
+
+    inverse_colormap_init(&ctx->map, opt->bit_depth, ctx->selected, palette_size, (size_t)w * h);
+    remap_rows(&ctx->map, ctx->in_rows, ctx->out_rows, w, h, channels);
+
+    convert_palette_depth(ctx->selected, palette_size, opt->bit_depth, opt->output_bit_depth);
+    for (int i = 0; i < palette_size; i++) {
+        palette[i].r = ctx->selected[i].r;
+        palette[i].g = ctx->selected[i].g;
+        palette[i].b = ctx->selected[i].b;
+    }
+    *pal_size = palette_size;
+    release_call_state(ctx);
+
+    set_die_handler(NULL);
+#ifdef _OPENMP
+    omp_set_num_threads(saved_threads);
+#endif
+    return LQ_OK;
+}
+
+const char* lq_error_string(lq_error err) {
+    switch (err) {
+    case LQ_OK: return "success";
+    case LQ_ERROR_INVALID_ARGUMENT: return "invalid argument";
+    case LQ_ERROR_OUT_OF_MEMORY: return "out of memory";
+    }
+    return "unknown error";
+}
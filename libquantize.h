@@ -0,0 +1,44 @@
+#ifndef LIBQUANTIZE_H
+#define LIBQUANTIZE_H
+
+#include <stddef.h>
+
+// In-memory palette quantization; no file I/O, errors are returned rather than exiting
+
+typedef struct lq_context lq_context;
+
+typedef enum {
+    LQ_OK = 0,
+    LQ_ERROR_INVALID_ARGUMENT,
+    LQ_ERROR_OUT_OF_MEMORY
+} lq_error;
+
+typedef struct {
+    int bit_depth;
+    int output_bit_depth;
+    int max_colors;
+    int skip;
+    int preselect;
+} lq_options;
+
+typedef struct {
+    unsigned char r, g, b;
+} lq_color;
+
+void lq_default_options(lq_options *opt);
+
+// num_threads <= 0 uses the OpenMP default
+lq_context* lq_create(int num_threads);
+void lq_destroy(lq_context *ctx);
+
+// Quantize w x h RGB (channels = 3) or RGBA (channels = 4) pixels, rows `stride` bytes apart.
+// Writes one palette index per pixel to `indices` (rows `index_stride` bytes apart) and up to
+// max_colors entries, at output_bit_depth, to `palette`. max_colors is limited to 256.
+lq_error lq_quantize(lq_context *ctx, const lq_options *opt,
+                     const unsigned char *pixels, int w, int h, int channels, size_t stride,
+                     unsigned char *indices, size_t index_stride,
+                     lq_color *palette, int *pal_size);
+
+const char* lq_error_string(lq_error err);
+
+#endif // LIBQUANTIZE_H
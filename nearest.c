@@ -0,0 +1,214 @@
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// Padding lanes sit far outside the 8-bit cube so they never win, yet their distance still fits in int16
+#define PAD_VALUE 2000
+#define SOA_ALIGN 16
+
+static int scalar_nearest(const PaletteSoA *p, int r, int g, int b, int *out_dist);
+static void scalar_update(const PaletteSoA *p, size_t lo, size_t hi, int r, int g, int b, int16_t *best);
+#ifdef HAVE_X86_KERNELS
+static int sse2_nearest(const PaletteSoA *p, int r, int g, int b, int *out_dist);
+static void sse2_update(const PaletteSoA *p, size_t lo, size_t hi, int r, int g, int b, int16_t *best);
+static int avx2_nearest(const PaletteSoA *p, int r, int g, int b, int *out_dist);
+static void avx2_update(const PaletteSoA *p, size_t lo, size_t hi, int r, int g, int b, int16_t *best);
+#endif
+
+static const NearestKernels scalar_kernels = { "scalar", scalar_nearest, scalar_update };
+#ifdef HAVE_X86_KERNELS
+static const NearestKernels sse2_kernels = { "sse2", sse2_nearest, sse2_update };
+static const NearestKernels avx2_kernels = { "avx2", avx2_nearest, avx2_update };
+#endif
+
+const NearestKernels* select_nearest_kernels(void) {
+    const char *force = getenv("QUANTIZE_SIMD");
+    if (force && !strcmp(force, "scalar")) return &scalar_kernels;
+#ifdef HAVE_X86_KERNELS
+    if (force && !strcmp(force, "sse2")) return &sse2_kernels;
+    if (__builtin_cpu_supports("avx2")) return &avx2_kernels;
+    if (__builtin_cpu_supports("sse2")) return &sse2_kernels;
+#endif
+    return &scalar_kernels;
+}
+
+static void palette_soa_alloc(PaletteSoA *p, size_t n) {
+    p->size = n;
+    p->padded = (n + SOA_ALIGN - 1) / SOA_ALIGN * SOA_ALIGN;
+    if (p->padded == 0) p->padded = SOA_ALIGN;
+    p->kernels = select_nearest_kernels();
+
+    p->r = malloc(3 * p->padded * sizeof(int16_t));
+    if (!p->r) die("malloc palette soa");
+    stats_count(&run_stats.bytes_allocated, 3 * p->padded * sizeof(int16_t));
+    p->g = p->r + p->padded;
+    p->b = p->g + p->padded;
+}
+
+void palette_soa_init(PaletteSoA *p, const Color *colors, size_t n) {
+    palette_soa_alloc(p, n);
+    for (size_t i = 0; i < p->padded; i++) {
+        p->r[i] = i < n ? colors[i].r : PAD_VALUE;
+        p->g[i] = i < n ? colors[i].g : PAD_VALUE;
+        p->b[i] = i < n ? colors[i].b : PAD_VALUE;
+    }
+}
+
+// Same, from packed 0xRRGGBB keys
+void palette_soa_init_keys(PaletteSoA *p, const uint32_t *keys, size_t n) {
+    palette_soa_alloc(p, n);
+    for (size_t i = 0; i < p->padded; i++) {
+        p->r[i] = i < n ? (int16_t)(keys[i] >> 16) : PAD_VALUE;
+        p->g[i] = i < n ? (int16_t)((keys[i] >> 8) & 0xFF) : PAD_VALUE;
+        p->b[i] = i < n ? (int16_t)(keys[i] & 0xFF) : PAD_VALUE;
+    }
+}
+
+void palette_soa_free(PaletteSoA *p) {
+    free(p->r);
+    p->r = p->g = p->b = NULL;
+}
+
+static inline int dist_scalar(int pr, int pg, int pb, int r, int g, int b) {
+    int dr = abs(pr - r);
+    int dg = abs(pg - g);
+    int db = abs(pb - b);
+    return dr + dg + db
+         + abs(dr - dg)
+         + abs(dr - db)
+         + abs(dg - db);
+}
+
+static int scalar_nearest(const PaletteSoA *p, int r, int g, int b, int *out_dist) {
+    int best_idx = 0;
+    int best_dist = dist_scalar(p->r[0], p->g[0], p->b[0], r, g, b);
+    for (size_t i = 1; i < p->size; i++) {
+        int d = dist_scalar(p->r[i], p->g[i], p->b[i], r, g, b);
+        if (d < best_dist) {
+            best_dist = d;
+            best_idx = (int)i;
+        }
+    }
+    if (out_dist) *out_dist = best_dist;
+    return best_idx;
+}
+
+static void scalar_update(const PaletteSoA *p, size_t lo, size_t hi, int r, int g, int b, int16_t *best) {
+    for (size_t i = lo; i < hi; i++) {
+        int d = dist_scalar(p->r[i], p->g[i], p->b[i], r, g, b);
+        if (d < best[i]) best[i] = d;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Lanes hold the running minimum and the block it came from; the lowest index wins ties, as in the scalar scan
+static int reduce_lanes(const int16_t *dist, const int16_t *block, int lanes, int *out_dist) {
+    int best_dist = INT16_MAX;
+    int best_idx = INT32_MAX;
+    for (int l = 0; l < lanes; l++) {
+        int idx = block[l] * lanes + l;
+        if (dist[l] < best_dist || (dist[l] == best_dist && idx < best_idx)) {
+            best_dist = dist[l];
+            best_idx = idx;
+        }
+    }
+    if (out_dist) *out_dist = best_dist;
+    return best_idx;
+}
+
+static inline __m128i sse2_abs16(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static inline __m128i sse2_dist(const PaletteSoA *p, size_t i, __m128i vr, __m128i vg, __m128i vb) {
+    __m128i dr = sse2_abs16(_mm_sub_epi16(_mm_loadu_si128((const __m128i*)&p->r[i]), vr));
+    __m128i dg = sse2_abs16(_mm_sub_epi16(_mm_loadu_si128((const __m128i*)&p->g[i]), vg));
+    __m128i db = sse2_abs16(_mm_sub_epi16(_mm_loadu_si128((const __m128i*)&p->b[i]), vb));
+    __m128i d = _mm_add_epi16(_mm_add_epi16(dr, dg), db);
+    d = _mm_add_epi16(d, sse2_abs16(_mm_sub_epi16(dr, dg)));
+    d = _mm_add_epi16(d, sse2_abs16(_mm_sub_epi16(dr, db)));
+    return _mm_add_epi16(d, sse2_abs16(_mm_sub_epi16(dg, db)));
+}
+
+static int sse2_nearest(const PaletteSoA *p, int r, int g, int b, int *out_dist) {
+    __m128i vr = _mm_set1_epi16(r), vg = _mm_set1_epi16(g), vb = _mm_set1_epi16(b);
+    __m128i min_d = _mm_set1_epi16(INT16_MAX);
+    __m128i min_blk = _mm_setzero_si128();
+    __m128i blk = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi16(1);
+
+    for (size_t i = 0; i < p->padded; i += 8) {
+        __m128i d = sse2_dist(p, i, vr, vg, vb);
+        __m128i lt = _mm_cmplt_epi16(d, min_d);
+        min_d = _mm_min_epi16(min_d, d);
+        min_blk = _mm_or_si128(_mm_and_si128(lt, blk), _mm_andnot_si128(lt, min_blk));
+        blk = _mm_add_epi16(blk, one);
+    }
+
+    int16_t dist[8], block[8];
+    _mm_storeu_si128((__m128i*)dist, min_d);
+    _mm_storeu_si128((__m128i*)block, min_blk);
+    return reduce_lanes(dist, block, 8, out_dist);
+}
+
+static void sse2_update(const PaletteSoA *p, size_t lo, size_t hi, int r, int g, int b, int16_t *best) {
+    __m128i vr = _mm_set1_epi16(r), vg = _mm_set1_epi16(g), vb = _mm_set1_epi16(b);
+    size_t i = lo;
+    for (; i + 8 <= hi; i += 8) {
+        __m128i d = sse2_dist(p, i, vr, vg, vb);
+        __m128i cur = _mm_loadu_si128((const __m128i*)&best[i]);
+        _mm_storeu_si128((__m128i*)&best[i], _mm_min_epi16(cur, d));
+    }
+    scalar_update(p, i, hi, r, g, b, best);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_dist(const PaletteSoA *p, size_t i, __m256i vr, __m256i vg, __m256i vb) {
+    __m256i dr = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)&p->r[i]), vr));
+    __m256i dg = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)&p->g[i]), vg));
+    __m256i db = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)&p->b[i]), vb));
+    __m256i d = _mm256_add_epi16(_mm256_add_epi16(dr, dg), db);
+    d = _mm256_add_epi16(d, _mm256_abs_epi16(_mm256_sub_epi16(dr, dg)));
+    d = _mm256_add_epi16(d, _mm256_abs_epi16(_mm256_sub_epi16(dr, db)));
+    return _mm256_add_epi16(d, _mm256_abs_epi16(_mm256_sub_epi16(dg, db)));
+}
+
+__attribute__((target("avx2")))
+static int avx2_nearest(const PaletteSoA *p, int r, int g, int b, int *out_dist) {
+    __m256i vr = _mm256_set1_epi16(r), vg = _mm256_set1_epi16(g), vb = _mm256_set1_epi16(b);
+    __m256i min_d = _mm256_set1_epi16(INT16_MAX);
+    __m256i min_blk = _mm256_setzero_si256();
+    __m256i blk = _mm256_setzero_si256();
+    __m256i one = _mm256_set1_epi16(1);
+
+    for (size_t i = 0; i < p->padded; i += 16) {
+        __m256i d = avx2_dist(p, i, vr, vg, vb);
+        __m256i lt = _mm256_cmpgt_epi16(min_d, d);
+        min_d = _mm256_min_epi16(min_d, d);
+        min_blk = _mm256_blendv_epi8(min_blk, blk, lt);
+        blk = _mm256_add_epi16(blk, one);
+    }
+
+    int16_t dist[16], block[16];
+    _mm256_storeu_si256((__m256i*)dist, min_d);
+    _mm256_storeu_si256((__m256i*)block, min_blk);
+    return reduce_lanes(dist, block, 16, out_dist);
+}
+
+__attribute__((target("avx2")))
+static void avx2_update(const PaletteSoA *p, size_t lo, size_t hi, int r, int g, int b, int16_t *best) {
+    __m256i vr = _mm256_set1_epi16(r), vg = _mm256_set1_epi16(g), vb = _mm256_set1_epi16(b);
+    size_t i = lo;
+    for (; i + 16 <= hi; i += 16) {
+        __m256i d = avx2_dist(p, i, vr, vg, vb);
+        __m256i cur = _mm256_loadu_si256((const __m256i*)&best[i]);
+        _mm256_storeu_si256((__m256i*)&best[i], _mm256_min_epi16(cur, d));
+    }
+    scalar_update(p, i, hi, r, g, b, best);
+}
+
+#endif
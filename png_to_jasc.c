@@ -1,5 +1,128 @@
 #include "utils.h"
 
+static void build_palette_from_colors(ColorCounts *all_colors, const char *out_path, const PaletteConfig *config) {
+    StageTimer t = stage_start();
+    int palette_size;
+    Color *palette = build_palette(all_colors, config, &palette_size);
+    report_sample_error(all_colors, palette, palette_size, config);
+    stage_stop(STAGE_PALETTE, t);
+
+    t = stage_start();
+    convert_palette_depth(palette, palette_size, config->bit_depth, config->output_bit_depth);
+    write_jasc_palette(out_path, palette, palette_size, config);
+    free(palette);
+    stage_stop(STAGE_ENCODE, t);
+}
+
+// Sub-palettes go to the output path, the per-tile assignment next to it with a .tiles suffix
+static void tile_palette_file(Workspace *ws, const Job *job, const PaletteConfig *config) {
+    StageTimer t = stage_start();
+    int w, h, channels;
+    png_bytep *rows = workspace_decode(ws, job->in_path, &w, &h, &channels);
+    stage_stop(STAGE_DECODE, t);
+
+    t = stage_start();
+    TilePalettes tp;
+    build_tile_palettes(&tp, rows, w, h, channels, config);
+    stage_stop(STAGE_PALETTE, t);
+
+    t = stage_start();
+    for (int p = 0; p < tp.num_palettes; p++)
+        convert_palette_depth(tp.palettes[p], tp.palette_sizes[p], config->bit_depth, config->output_bit_depth);
+    write_jasc_palette_set(job->out_path, tp.palettes, tp.palette_sizes, tp.num_palettes, config);
+
+    size_t len = strlen(job->out_path);
+    char *tiles_path = malloc(len + sizeof(".tiles"));
+    if (!tiles_path) die("malloc tiles path");
+    memcpy(tiles_path, job->out_path, len);
+    memcpy(tiles_path + len, ".tiles", sizeof(".tiles"));
+    write_tile_assignment(tiles_path, &tp);
+    free(tiles_path);
+    free_tile_palettes(&tp);
+    stage_stop(STAGE_ENCODE, t);
+}
+
+static void palette_file(Workspace *ws, const Job *job, const PaletteConfig *config) {
+    if (config->tile_size > 0) {
+        tile_palette_file(ws, job, config);
+        return;
+    }
+
+    ColorCounts all_colors;
+    Sampler sampler;
+    sampler_init(&sampler, config);
+    StageTimer t;
+    if (config->strip_rows > 0) {
+        t = stage_start();
+        PngSource source;
+        png_source_open(&source, job->in_path);
+        collect_colors_streamed(&source, config->strip_rows, config->bit_depth, &sampler, &all_colors);
+        png_source_close(&source);
+        stage_stop(STAGE_HISTOGRAM, t);
+    } else {
+        t = stage_start();
+        int w, h, channels;
+        png_bytep *rows = workspace_decode(ws, job->in_path, &w, &h, &channels);
+        stage_stop(STAGE_DECODE, t);
+
+        t = stage_start();
+        workspace_collect_colors(ws, rows, w, h, channels, &sampler, &all_colors);
+        stage_stop(STAGE_HISTOGRAM, t);
+    }
+
+    build_palette_from_colors(&all_colors, job->out_path, config);
+    color_counts_free(&all_colors);
+}
+
+// One palette for every input: each thread streams whole files into its own slot of a shared histogram,
+// and the optional saved histogram lets later runs merge only the new files
+static void shared_palette(const JobList *jobs, const PaletteConfig *config, int num_threads) {
+    int strip_rows = config->strip_rows > 0 ? config->strip_rows : SHARED_STRIP_ROWS;
+    ColorHistogram hist;
+    histogram_init(&hist, config->bit_depth, num_threads);
+    Sampler sampler;
+    sampler_init(&sampler, config);
+
+    StageTimer t = stage_start();
+    if (config->histogram_path) {
+        ColorCounts saved;
+        histogram_load(config->histogram_path, config->bit_depth, &saved);
+        if (config->verbose) fprintf(stderr, "loaded %zu colors from %s\n", saved.size, config->histogram_path);
+        histogram_add_colors(&hist, &saved);
+        color_counts_free(&saved);
+    }
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+#endif
+    for (int i = 0; i < jobs->count; i++) {
+#ifdef _OPENMP
+        ColorHistogram slot = histogram_slot(&hist, omp_get_thread_num());
+#else
+        ColorHistogram slot = histogram_slot(&hist, 0);
+#endif
+        PngSource source;
+        png_source_open(&source, jobs->jobs[i].in_path);
+        histogram_add_source(&slot, &source, strip_rows, &sampler);
+        png_source_close(&source);
+    }
+
+    ColorCounts all_colors;
+    histogram_colors(&hist, &all_colors);
+    histogram_free(&hist);
+    stats_count(&run_stats.unique_colors, all_colors.size);
+    if (config->histogram_path) histogram_save(config->histogram_path, &all_colors, config->bit_depth);
+    stage_stop(STAGE_HISTOGRAM, t);
+    if (config->verbose) fprintf(stderr, "added %d images, %zu unique colors in total\n", jobs->count, all_colors.size);
+
+    if (all_colors.size == 0) {
+        fprintf(stderr, "no colors to build a palette from\n");
+        exit(1);
+    }
+    build_palette_from_colors(&all_colors, config->shared_palette_path, config);
+    color_counts_free(&all_colors);
+}
+
 int main(int argc, char **argv) {
     PaletteConfig config = {
         .bit_depth = 8,
@@ -7,30 +130,46 @@ int main(int argc, char **argv) {
         .max_colors = 256,
         .skip = 0,
         .preselect = 1,
-        .verbose = 0
+        .verbose = 0,
+        .strip_rows = 0,
+        .stats_path = NULL,
+        .compression_level = Z_DEFAULT_COMPRESSION
     };
     
-    const char *in_path, *out_path;
-    parse_arguments(argc, argv, &config, &in_path, &out_path);
-
-    int w, h, channels;
-    png_bytep *rows = read_png_image(in_path, &w, &h, &channels);
-
-    size_t num_colors;
-    Color *all_colors = collect_colors(rows, w, h, channels, config.bit_depth, &num_colors, config.verbose);
-
-    for (int y = 0; y < h; y++) {
-        free(rows[y]);
+    JobList jobs;
+    parse_arguments(argc, argv, &config, &jobs);
+    if (config.palette_path || config.incremental || config.raw_format != RAW_NONE) {
+        fprintf(stderr, "-P, -cache and -raw are only supported by quantize_png\n");
+        exit(1);
     }
-    free(rows);
+    Sampler sampler;
+    sampler_init(&sampler, &config);
+    if (config.tile_size > 0 && (config.strip_rows > 0 || config.shared_palette_path || sampler.active)) {
+        fprintf(stderr, "-t cannot be combined with -S, -u or -sample\n");
+        exit(1);
+    }
+    double start = wall_seconds();
 
-    int palette_size;
-    Color *palette = build_palette(all_colors, num_colors, &config, &palette_size);
-    free(all_colors);
+#ifdef _OPENMP
+    int num_threads = omp_get_max_threads();
+#else
+    int num_threads = 1;
+#endif
+    if (config.verbose) fprintf(stderr, "using %d threads\n", num_threads);
 
-    convert_palette_depth(palette, palette_size, config.bit_depth, config.output_bit_depth);
-    write_jasc_palette(out_path, palette, palette_size, &config);
-    free(palette);
+    if (config.shared_palette_path) {
+        shared_palette(&jobs, &config, num_threads);
+    } else if (jobs.count == 1) {
+        Workspace ws;
+        workspace_init(&ws, config.bit_depth, num_threads);
+        palette_file(&ws, &jobs.jobs[0], &config);
+        workspace_free(&ws);
+    } else {
+        run_batch(&jobs, &config, palette_file);
+    }
 
+    if (config.stats_path) write_run_stats(config.stats_path, "png_to_jasc", &jobs, num_threads, wall_seconds() - start);
+    if (config.verbose) fprintf(stderr, "peak RSS: %ld KiB\n", peak_rss_kib());
+    free_jobs(&jobs);
     return 0;
 }
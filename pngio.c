@@ -0,0 +1,133 @@
+#define _POSIX_C_SOURCE 200809L
+#include "utils.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STDIN_CHUNK (1 << 20)
+
+// Reads the whole stream; used for stdin and anything that can't be mapped, such as a pipe given by path
+static void read_all(PngSource *src, FILE *in, const char *name) {
+    size_t cap = STDIN_CHUNK, size = 0;
+    unsigned char *data = malloc(cap);
+    if (!data) die("malloc input buffer");
+    size_t got;
+    while ((got = fread(data + size, 1, cap - size, in)) > 0) {
+        size += got;
+        if (size == cap) {
+            cap *= 2;
+            unsigned char *grown = realloc(data, cap);
+            if (!grown) die("realloc input buffer");
+            data = grown;
+        }
+    }
+    if (ferror(in)) {
+        fprintf(stderr, "Failed to read input: %s\n", name);
+        die("read input");
+    }
+    stats_count(&run_stats.bytes_allocated, cap);
+    src->data = data;
+    src->size = size;
+    src->owned = data;
+}
+
+// "-" is stdin; regular files are mapped read-only rather than copied through stdio buffers
+void png_source_open(PngSource *src, const char *path) {
+    memset(src, 0, sizeof(*src));
+    if (!strcmp(path, "-")) {
+        read_all(src, stdin, "stdin");
+        return;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open input file: %s\n", path);
+        die("open input");
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            posix_madvise(mapping, st.st_size, POSIX_MADV_SEQUENTIAL);
+            close(fd);
+            src->data = mapping;
+            src->size = st.st_size;
+            src->mapping = mapping;
+            return;
+        }
+    }
+
+    FILE *in = fdopen(fd, "rb");
+    if (!in) die("fdopen input");
+    read_all(src, in, path);
+    fclose(in);
+}
+
+void png_source_memory(PngSource *src, const void *data, size_t size) {
+    memset(src, 0, sizeof(*src));
+    src->data = data;
+    src->size = size;
+}
+
+void png_source_close(PngSource *src) {
+    if (src->mapping) munmap(src->mapping, src->size);
+    free(src->owned);
+    memset(src, 0, sizeof(*src));
+}
+
+void png_source_read_fn(png_structp png, png_bytep out, size_t n) {
+    PngSource *src = png_get_io_ptr(png);
+    if (n > src->size - src->pos) png_error(png, "unexpected end of PNG data");
+    memcpy(out, src->data + src->pos, n);
+    src->pos += n;
+}
+
+// "-" is stdout; otherwise a file, or a growing memory buffer when path is NULL
+void png_sink_open(PngSink *sink, const char *path) {
+    memset(sink, 0, sizeof(*sink));
+    if (!path) return;
+    if (!strcmp(path, "-")) {
+        sink->fp = stdout;
+        return;
+    }
+    sink->fp = fopen(path, "wb");
+    if (!sink->fp) {
+        fprintf(stderr, "Failed to open output file: %s\n", path);
+        die("open output");
+    }
+    sink->close_fp = 1;
+}
+
+void png_sink_write(PngSink *sink, const void *data, size_t n) {
+    if (sink->fp) {
+        if (n && fwrite(data, n, 1, sink->fp) != 1) die("write output");
+        return;
+    }
+    if (sink->size + n > sink->cap) {
+        size_t cap = sink->cap ? sink->cap : 4096;
+        while (cap < sink->size + n) cap *= 2;
+        unsigned char *grown = realloc(sink->data, cap);
+        if (!grown) die("realloc output buffer");
+        sink->data = grown;
+        sink->cap = cap;
+    }
+    memcpy(sink->data + sink->size, data, n);
+    sink->size += n;
+}
+
+// Memory sinks keep their buffer; the caller owns sink->data afterwards
+void png_sink_close(PngSink *sink) {
+    if (!sink->fp) return;
+    if ((sink->close_fp ? fclose(sink->fp) : fflush(sink->fp)) != 0) die("write output");
+    sink->fp = NULL;
+}
+
+void png_sink_write_fn(png_structp png, png_bytep data, size_t n) {
+    png_sink_write(png_get_io_ptr(png), data, n);
+}
+
+void png_sink_flush_fn(png_structp png) {
+    PngSink *sink = png_get_io_ptr(png);
+    if (sink->fp) fflush(sink->fp);
+}
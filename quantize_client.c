@@ -0,0 +1,145 @@
+#define _XOPEN_SOURCE 700
+#include "utils.h"
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [-path] [-r repeats] socket_path [quantize_png options] input.png output.png [...]\n"
+        "\t -path (send the absolute input path for the daemon to read instead of the PNG bytes) \n"
+        "\t -r repeats (send each image this many times and report the best and mean latency) \n", prog);
+    exit(1);
+}
+
+// Sends one image, waits for its response, and returns the encoded PNG (NULL after printing the daemon's error)
+static unsigned char* round_trip(int fd, const DaemonRequest *req, const void *payload, size_t payload_size,
+                                 DaemonResponse *resp) {
+    if (write_full(fd, req, sizeof(*req)) || write_full(fd, payload, payload_size)) die("send request");
+    if (read_full(fd, resp, sizeof(*resp)) || resp->magic != DAEMON_MAGIC) die("read response");
+
+    unsigned char *data = malloc(resp->data_len + 1);
+    if (!data) die("malloc response");
+    if (read_full(fd, data, resp->data_len)) die("read response");
+    if (resp->status != 0) {
+        data[resp->data_len] = '\0';
+        fprintf(stderr, "daemon error: %s\n", (char*)data);
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+int main(int argc, char **argv) {
+    int send_path = 0, repeats = 1;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-path")) send_path = 1;
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc) repeats = atoi(argv[++i]);
+        else usage(argv[0]);
+    }
+    if (i >= argc || repeats < 1) usage(argv[0]);
+    const char *socket_path = argv[i];
+
+    // The remaining arguments are quantize_png's, so the same option parser applies
+    PaletteConfig config = {
+        .bit_depth = 8,
+        .output_bit_depth = 8,
+        .max_colors = 256,
+        .skip = 0,
+        .preselect = 1,
+        .verbose = 0,
+        .strip_rows = 0,
+        .stats_path = NULL,
+        .compression_level = Z_DEFAULT_COMPRESSION
+    };
+    argv[i] = argv[0];
+    JobList jobs;
+    parse_arguments(argc - i, &argv[i], &config, &jobs);
+    Sampler sampler;
+    sampler_init(&sampler, &config);
+    if (config.palette_path || config.shared_palette_path || config.tile_size > 0 || config.strip_rows > 0
+        || sampler.active || config.incremental || config.kmeans_iterations > 0
+        || config.raw_format != RAW_NONE) {
+        fprintf(stderr, "-P, -u, -t, -S, -sample, -cache, -k and -raw are not supported by the daemon\n");
+        exit(1);
+    }
+
+    DaemonRequest req = {
+        .magic = DAEMON_MAGIC,
+        .bit_depth = config.bit_depth,
+        .output_bit_depth = config.output_bit_depth,
+        .max_colors = config.max_colors,
+        .skip = config.skip,
+        .preselect = config.preselect,
+        .dither = config.dither,
+        .compression_level = config.compression_level,
+        .png_filter = config.png_filter
+    };
+
+    // A daemon that drops the connection is reported by the failed write rather than killing the client
+    signal(SIGPIPE, SIG_IGN);
+    int fd = unix_socket_connect(socket_path);
+    int failed = 0;
+    for (int j = 0; j < jobs.count; j++) {
+        const Job *job = &jobs.jobs[j];
+        PngSource source = { 0 };
+        char resolved[PATH_MAX];
+        const void *payload;
+        if (send_path) {
+            if (!realpath(job->in_path, resolved)) {
+                fprintf(stderr, "Failed to resolve input path: %s\n", job->in_path);
+                die("realpath");
+            }
+            req.path_len = strlen(resolved);
+            req.data_len = 0;
+            payload = resolved;
+        } else {
+            png_source_open(&source, job->in_path);
+            req.path_len = 0;
+            req.data_len = source.size;
+            payload = source.data;
+        }
+        size_t payload_size = send_path ? req.path_len : req.data_len;
+
+        double best = 0, sum = 0;
+        uint64_t best_daemon_us = 0;
+        DaemonResponse resp;
+        unsigned char *png = NULL;
+        for (int r = 0; r < repeats; r++) {
+            free(png);
+            double t0 = wall_seconds();
+            png = round_trip(fd, &req, payload, payload_size, &resp);
+            double elapsed = wall_seconds() - t0;
+            if (!png) break;
+            if (r == 0 || elapsed < best) best = elapsed;
+            if (r == 0 || resp.latency_us < best_daemon_us) best_daemon_us = resp.latency_us;
+            sum += elapsed;
+        }
+        png_source_close(&source);
+        if (!png) {
+            failed = 1;
+            continue;
+        }
+
+        PngSink sink;
+        png_sink_open(&sink, job->out_path);
+        png_sink_write(&sink, png, resp.data_len);
+        png_sink_close(&sink);
+        free(png);
+
+        if (repeats > 1) {
+            fprintf(stderr, "%s: %dx%d, %d colors, daemon %.3f ms, round trip %.3f ms (mean %.3f ms over %d)\n",
+                    job->in_path, resp.w, resp.h, resp.palette_size, best_daemon_us * 1e-3, best * 1e3,
+                    sum / repeats * 1e3, repeats);
+        } else {
+            fprintf(stderr, "%s: %dx%d, %d colors, daemon %.3f ms, round trip %.3f ms\n",
+                    job->in_path, resp.w, resp.h, resp.palette_size, best_daemon_us * 1e-3, best * 1e3);
+        }
+    }
+
+    close(fd);
+    free_jobs(&jobs);
+    return failed;
+}
@@ -0,0 +1,244 @@
+#define _POSIX_C_SOURCE 200809L
+#include "utils.h"
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define DAEMON_MAX_PATH 4096
+#define DAEMON_DEFAULT_IDLE_SECONDS 10
+
+// Everything a worker keeps between requests, so a request only allocates when its image is larger than any before
+typedef struct {
+    Workspace ws;
+    int bit_depth;
+    unsigned char *input;
+    size_t input_cap;
+    PngSource source;
+    PngSink output;
+    // The current request's colors, palette and remap state, here so a failed request can free them
+    ColorCounts colors;
+    Color *palette;
+    InverseColormap map;
+    Dither dither;
+} Worker;
+
+static int verbose = 0;
+static int idle_seconds = DAEMON_DEFAULT_IDLE_SECONDS;
+
+static void worker_init(Worker *wk) {
+    memset(wk, 0, sizeof(*wk));
+    wk->bit_depth = 8;
+    workspace_init(&wk->ws, wk->bit_depth, 1);
+}
+
+static void worker_release_request(Worker *wk) {
+    color_counts_free(&wk->colors);
+    free(wk->palette);
+    wk->palette = NULL;
+    inverse_colormap_free(&wk->map);
+    dither_free(&wk->dither);
+    memset(&wk->dither, 0, sizeof(wk->dither));
+}
+
+// A failed request can leave the histogram tables half-grown, so they are rebuilt from scratch
+static void worker_reset_histogram(Worker *wk, int bit_depth) {
+    histogram_free(&wk->ws.hist);
+    histogram_init(&wk->ws.hist, bit_depth, 1);
+    wk->bit_depth = bit_depth;
+}
+
+// Framing errors leave the stream unreadable, so they close the connection
+static const char* check_framing(const DaemonRequest *req) {
+    if (req->magic != DAEMON_MAGIC) return "bad request header";
+    if (req->path_len > DAEMON_MAX_PATH) return "path too long";
+    if (!req->path_len && (req->data_len < 1 || req->data_len > DAEMON_MAX_INPUT)) return "bad input size";
+    if (req->path_len && req->data_len) return "expected a path or PNG data, not both";
+    return NULL;
+}
+
+static const char* check_options(const DaemonRequest *req) {
+    if (req->bit_depth < 1 || req->bit_depth > 8) return "bit_depth must be in [1, 8]";
+    if (req->output_bit_depth < req->bit_depth || req->output_bit_depth > 8)
+        return "output_bit_depth must be in [bit_depth, 8]";
+    if (req->max_colors < 1 || req->max_colors > 256) return "max_colors must be in [1, 256]";
+    if (req->skip < 0 || req->max_colors - req->skip < 1 || req->preselect < 0) return "bad skip or preselect";
+    if (req->dither < DITHER_NONE || req->dither > DITHER_ORDERED) return "bad dither mode";
+    if (req->compression_level < Z_DEFAULT_COMPRESSION || req->compression_level > 9) return "bad compression level";
+    if (req->png_filter < FILTER_NONE || req->png_filter > FILTER_ADAPTIVE) return "bad PNG filter";
+    return NULL;
+}
+
+static int send_response(int fd, DaemonResponse *resp, const void *data, size_t size) {
+    resp->magic = DAEMON_MAGIC;
+    resp->data_len = size;
+    if (write_full(fd, resp, sizeof(*resp))) return -1;
+    return write_full(fd, data, size);
+}
+
+static int send_error(int fd, const char *msg) {
+    DaemonResponse resp = { .status = 1 };
+    return send_response(fd, &resp, msg, strlen(msg));
+}
+
+// The same pipeline as quantize_png, single-threaded, encoding into the worker's memory sink
+static void quantize_request(Worker *wk, const PaletteConfig *config, DaemonResponse *resp) {
+    if (wk->bit_depth != config->bit_depth) worker_reset_histogram(wk, config->bit_depth);
+
+    int w, h, channels;
+    png_bytep *rows = workspace_decode_source(&wk->ws, &wk->source, &w, &h, &channels);
+
+    workspace_collect_colors(&wk->ws, rows, w, h, channels, NULL, &wk->colors);
+    int palette_size;
+    wk->palette = build_palette(&wk->colors, config, &palette_size);
+    color_counts_free(&wk->colors);
+
+    png_bytep *index_rows = workspace_index_rows(&wk->ws, w, h);
+    inverse_colormap_init(&wk->map, config->bit_depth, wk->palette, palette_size, (size_t)w * h);
+    dither_init(&wk->dither, &wk->map, config->dither, w);
+    dither_rows(&wk->dither, &wk->map, rows, index_rows, h, channels);
+
+    convert_palette_depth(wk->palette, palette_size, config->bit_depth, config->output_bit_depth);
+    wk->output.size = 0;
+    encode_palette_png(&wk->output, w, h, wk->palette, palette_size, index_rows, config);
+    worker_release_request(wk);
+
+    resp->w = w;
+    resp->h = h;
+    resp->palette_size = palette_size;
+}
+
+// Returns 0 when the connection can carry another request
+static int serve_request(Worker *wk, int fd) {
+    DaemonRequest req;
+    if (read_full(fd, &req, sizeof(req))) return -1;
+    const char *error = check_framing(&req);
+    if (error) {
+        send_error(fd, error);
+        return -1;
+    }
+
+    char path[DAEMON_MAX_PATH + 1];
+    if (req.path_len) {
+        if (read_full(fd, path, req.path_len)) return -1;
+        path[req.path_len] = '\0';
+    } else {
+        if (req.data_len > wk->input_cap) {
+            free(wk->input);
+            wk->input = malloc(req.data_len);
+            wk->input_cap = wk->input ? req.data_len : 0;
+            if (!wk->input) {
+                send_error(fd, "out of memory");
+                return -1;
+            }
+        }
+        if (read_full(fd, wk->input, req.data_len)) return -1;
+    }
+    if ((error = check_options(&req))) return send_error(fd, error);
+    double start = wall_seconds();
+
+    PaletteConfig config = {
+        .bit_depth = req.bit_depth,
+        .output_bit_depth = req.output_bit_depth,
+        .max_colors = req.max_colors,
+        .skip = req.skip,
+        .preselect = req.preselect,
+        .verbose = 0,
+        .strip_rows = 0,
+        .stats_path = NULL,
+        .compression_level = req.compression_level,
+        .png_filter = (RowFilter)req.png_filter,
+        .dither = (DitherMode)req.dither
+    };
+    DaemonResponse resp = { .status = 0 };
+
+    // Decode errors and failed allocations come back here instead of exiting the daemon.
+    // The libpng structs of an aborted decode are leaked; they are a few KiB.
+    jmp_buf on_error;
+    if (setjmp(on_error)) {
+        set_die_handler(NULL);
+        worker_release_request(wk);
+        png_source_close(&wk->source);
+        worker_reset_histogram(wk, req.bit_depth);
+        if (verbose) fprintf(stderr, "request failed after %.3f ms\n", (wall_seconds() - start) * 1e3);
+        return send_error(fd, req.path_len ? "failed to read or quantize the PNG file" : "failed to quantize the PNG data");
+    }
+    set_die_handler(&on_error);
+    if (req.path_len)
+        png_source_open(&wk->source, path);
+    else
+        png_source_memory(&wk->source, wk->input, req.data_len);
+    quantize_request(wk, &config, &resp);
+    png_source_close(&wk->source);
+    set_die_handler(NULL);
+
+    resp.latency_us = (uint64_t)((wall_seconds() - start) * 1e6);
+    if (verbose) {
+        fprintf(stderr, "%dx%d, %d colors, %zu bytes out, %.3f ms\n",
+                resp.w, resp.h, resp.palette_size, wk->output.size, resp.latency_us * 1e-3);
+    }
+    return send_response(fd, &resp, wk->output.data, wk->output.size);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [options] socket_path\n"
+        "options: \n"
+        "\t -w workers (concurrent connections, default: number of threads) \n"
+        "\t -t seconds (close a connection that sends nothing for this long, 0 = never, default: %d) \n"
+        "\t -v (log every request with its latency) \n", prog, DAEMON_DEFAULT_IDLE_SECONDS);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+#ifdef _OPENMP
+    int workers = omp_get_max_threads();
+#else
+    int workers = 1;
+#endif
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-w") && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) idle_seconds = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-v")) verbose = 1;
+        else usage(argv[0]);
+    }
+    if (i != argc - 1 || workers < 1 || idle_seconds < 0) usage(argv[0]);
+
+    // A client that disconnects mid-response must not take the daemon down
+    signal(SIGPIPE, SIG_IGN);
+    int listen_fd = unix_socket_listen(argv[i]);
+    if (verbose) fprintf(stderr, "listening on %s with %d workers\n", argv[i], workers);
+
+    // The team lives as long as the daemon: each worker owns a connection at a time, runs every
+    // request on it single-threaded, and keeps its buffers warm for the next one
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(workers)
+#endif
+    {
+#ifdef _OPENMP
+        omp_set_num_threads(1);
+#endif
+        Worker wk;
+        worker_init(&wk);
+        for (;;) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd < 0) {
+                if (errno != EINTR && errno != ECONNABORTED) perror("accept");
+                continue;
+            }
+            // A worker owns its connection until it closes, so a client that goes quiet or stalls
+            // mid-request would hold the worker forever; timed-out reads and writes end the connection
+            if (idle_seconds) {
+                struct timeval timeout = { .tv_sec = idle_seconds };
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            }
+            while (serve_request(&wk, fd) == 0)
+                ;
+            close(fd);
+        }
+    }
+    return 0;
+}
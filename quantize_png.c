@@ -1,5 +1,159 @@
 #include "utils.h"
 
+// The palette matching is done at the logical depth; a loaded palette keeps its exact file values for output
+static Color* fixed_palette_copy(const PaletteConfig *config, int *palette_size) {
+    Color *palette = malloc(config->fixed_palette_size * sizeof(Color));
+    if (!palette) die("malloc palette");
+    memcpy(palette, config->fixed_palette, config->fixed_palette_size * sizeof(Color));
+    reduce_palette_depth(palette, config->fixed_palette_size, config->bit_depth, config->output_bit_depth);
+    *palette_size = config->fixed_palette_size;
+    return palette;
+}
+
+static void output_palette(Color *palette, int palette_size, const PaletteConfig *config) {
+    if (config->fixed_palette)
+        memcpy(palette, config->fixed_palette, palette_size * sizeof(Color));
+    else
+        convert_palette_depth(palette, palette_size, config->bit_depth, config->output_bit_depth);
+}
+
+static void quantize_streamed(const char *in_path, const char *out_path, const PaletteConfig *config) {
+    // Both passes decode from one source, so "-" (stdin) is read once and never spooled to a temporary file
+    PngSource source;
+    png_source_open(&source, in_path);
+
+    StageTimer t;
+    int palette_size;
+    Color *palette;
+    if (config->fixed_palette) {
+        palette = fixed_palette_copy(config, &palette_size);
+    } else {
+        t = stage_start();
+        Sampler sampler;
+        sampler_init(&sampler, config);
+        ColorCounts all_colors;
+        collect_colors_streamed(&source, config->strip_rows, config->bit_depth, &sampler, &all_colors);
+        stage_stop(STAGE_HISTOGRAM, t);
+
+        t = stage_start();
+        palette = build_palette(&all_colors, config, &palette_size);
+        report_sample_error(&all_colors, palette, palette_size, config);
+        color_counts_free(&all_colors);
+        stage_stop(STAGE_PALETTE, t);
+    }
+
+    // Second decode (the only one with -P): remap and encode one strip at a time instead of holding the whole image
+    PngReader reader;
+    png_reader_open_source(&reader, &source);
+
+    t = stage_start();
+    InverseColormap map;
+    inverse_colormap_init(&map, config->bit_depth, palette, palette_size, (size_t)reader.w * reader.h);
+    Dither dither;
+    dither_init(&dither, &map, config->dither, reader.w);
+    stage_stop(STAGE_REMAP, t);
+    output_palette(palette, palette_size, config);
+
+    PngWriter writer;
+    png_writer_open(&writer, out_path, reader.w, reader.h, palette, palette_size, config);
+
+    png_bytep *rows = alloc_rows(config->strip_rows, reader.row_bytes);
+    png_bytep *index_rows = alloc_rows(config->strip_rows, reader.w);
+    for (int y = 0; y < reader.h; y += config->strip_rows) {
+        int n = reader.h - y < config->strip_rows ? reader.h - y : config->strip_rows;
+        t = stage_start();
+        png_reader_read_rows(&reader, rows, n);
+        stage_stop(STAGE_DECODE, t);
+
+        t = stage_start();
+        dither_rows(&dither, &map, rows, index_rows, n, reader.channels);
+        stage_stop(STAGE_REMAP, t);
+
+        t = stage_start();
+        png_writer_write_rows(&writer, index_rows, n);
+        stage_stop(STAGE_ENCODE, t);
+    }
+
+    free_rows(rows);
+    free_rows(index_rows);
+    png_writer_close(&writer);
+    png_reader_close(&reader);
+    png_source_close(&source);
+    dither_free(&dither);
+    inverse_colormap_free(&map);
+    free(palette);
+}
+
+static void quantize_file(Workspace *ws, const Job *job, const PaletteConfig *config) {
+    if (config->strip_rows > 0) {
+        quantize_streamed(job->in_path, job->out_path, config);
+        return;
+    }
+
+    StageTimer t = stage_start();
+    int w, h, channels;
+    png_bytep *rows = workspace_decode(ws, job->in_path, &w, &h, &channels);
+    stage_stop(STAGE_DECODE, t);
+
+    StripCache cache;
+    if (config->incremental) {
+        t = stage_start();
+        strip_cache_open(&cache, job->out_path, rows, w, h, channels, config);
+        stage_stop(STAGE_HISTOGRAM, t);
+    }
+
+    int palette_size;
+    Color *palette;
+    if (config->fixed_palette) {
+        palette = fixed_palette_copy(config, &palette_size);
+    } else {
+        t = stage_start();
+        Sampler sampler;
+        sampler_init(&sampler, config);
+        ColorCounts all_colors;
+        if (config->incremental)
+            strip_cache_colors(&cache, ws, rows, &sampler, &all_colors);
+        else
+            workspace_collect_colors(ws, rows, w, h, channels, &sampler, &all_colors);
+        stage_stop(STAGE_HISTOGRAM, t);
+
+        t = stage_start();
+        palette = build_palette(&all_colors, config, &palette_size);
+        report_sample_error(&all_colors, palette, palette_size, config);
+        color_counts_free(&all_colors);
+        stage_stop(STAGE_PALETTE, t);
+    }
+
+    t = stage_start();
+    png_bytep *index_rows = workspace_index_rows(ws, w, h);
+    if (config->incremental) {
+        strip_cache_remap(&cache, rows, index_rows, palette, palette_size, config);
+    } else {
+        InverseColormap map;
+        inverse_colormap_init(&map, config->bit_depth, palette, palette_size, (size_t)w * h);
+        Dither dither;
+        dither_init(&dither, &map, config->dither, w);
+        dither_rows(&dither, &map, rows, index_rows, h, channels);
+        dither_free(&dither);
+        inverse_colormap_free(&map);
+    }
+    stage_stop(STAGE_REMAP, t);
+
+    t = stage_start();
+    if (config->incremental) {
+        strip_cache_save(&cache, index_rows, palette, palette_size, config);
+        strip_cache_free(&cache);
+    }
+    output_palette(palette, palette_size, config);
+    if (config->raw_format != RAW_NONE)
+        write_raw_output(job->out_path, w, h, palette, palette_size, index_rows, config);
+    else
+        write_palette_png(job->out_path, w, h, palette, palette_size, index_rows, config);
+    stage_stop(STAGE_ENCODE, t);
+    
+    free(palette);
+}
+
 int main(int argc, char **argv) {
     PaletteConfig config = {
         .bit_depth = 8,
@@ -7,37 +161,65 @@ int main(int argc, char **argv) {
         .max_colors = 256,
         .skip = 0,
         .preselect = 1,
-        .verbose = 0
+        .verbose = 0,
+        .strip_rows = 0,
+        .stats_path = NULL,
+        .compression_level = Z_DEFAULT_COMPRESSION
     };
     
-    const char *in_path, *out_path;
-    parse_arguments(argc, argv, &config, &in_path, &out_path);
-
-    int w, h, channels;
-    png_bytep *rows = read_png_image(in_path, &w, &h, &channels);
-
-    size_t num_colors;
-    Color *all_colors = collect_colors(rows, w, h, channels, config.bit_depth, &num_colors, config.verbose);
-
-    int palette_size;
-    Color *palette = build_palette(all_colors, num_colors, &config, &palette_size);
-    free(all_colors);
-
-    png_bytep *index_rows = quantize_image(rows, w, h, channels, config.bit_depth, palette, palette_size);
-    
-    for (int y = 0;y < h; y++) {
-        free(rows[y]);
+    JobList jobs;
+    parse_arguments(argc, argv, &config, &jobs);
+    if (config.shared_palette_path) {
+        fprintf(stderr, "-u is only supported by png_to_jasc; apply its palette with -P\n");
+        exit(1);
+    }
+    if (config.tile_size > 0) {
+        fprintf(stderr, "-t is only supported by png_to_jasc\n");
+        exit(1);
+    }
+    if (config.incremental && config.strip_rows > 0) {
+        fprintf(stderr, "-cache keeps the whole image; it can't be combined with -S\n");
+        exit(1);
+    }
+    if (config.raw_format != RAW_NONE && config.strip_rows > 0) {
+        fprintf(stderr, "-raw writes from the whole index buffer; it can't be combined with -S\n");
+        exit(1);
+    }
+    for (int j = 0; (config.incremental || config.raw_format != RAW_NONE) && j < jobs.count; j++) {
+        if (!strcmp(jobs.jobs[j].out_path, "-")) {
+            fprintf(stderr, "%s is stored next to the output, so the output can't be stdout\n",
+                    config.incremental ? "-cache" : "The -raw palette");
+            exit(1);
+        }
+    }
+    double start = wall_seconds();
+    if (config.palette_path)
+        config.fixed_palette = read_jasc_palette(config.palette_path, config.output_bit_depth, &config.fixed_palette_size);
+    if (config.fixed_palette && config.raw_bpp && config.fixed_palette_size > 1 << config.raw_bpp) {
+        fprintf(stderr, "%s has %d colors, more than -bpp %d can index\n",
+                config.palette_path, config.fixed_palette_size, config.raw_bpp);
+        exit(1);
     }
-    free(rows);
 
-    convert_palette_depth(palette, palette_size, config.bit_depth, config.output_bit_depth);
-    write_palette_png(out_path, w, h, palette, palette_size, index_rows);
-    
-    free(palette);
-    for (int y = 0; y < h; y++) {
-        free(index_rows[y]);
+#ifdef _OPENMP
+    int num_threads = omp_get_max_threads();
+#else
+    int num_threads = 1;
+#endif
+    if (config.verbose) fprintf(stderr, "using %d threads\n", num_threads);
+
+    if (jobs.count == 1) {
+        Workspace ws;
+        workspace_init(&ws, config.bit_depth, num_threads);
+        quantize_file(&ws, &jobs.jobs[0], &config);
+        workspace_free(&ws);
+    } else {
+        run_batch(&jobs, &config, quantize_file);
     }
-    free(index_rows);
 
+    if (config.stats_path) write_run_stats(config.stats_path, "quantize_png", &jobs, num_threads, wall_seconds() - start);
+    if (config.verbose) fprintf(stderr, "peak RSS: %ld KiB\n", peak_rss_kib());
+    free(config.fixed_palette);
+    free_jobs(&jobs);
     return 0;
 }
@@ -0,0 +1,139 @@
+#include "utils.h"
+
+#define RADIX_BITS 8
+#define RADIX_DIGITS (1 << RADIX_BITS)
+// Three key bytes (keys are 24 bits wide) then eight count bytes
+#define KEY_PASSES 3
+#define NUM_PASSES (KEY_PASSES + 8)
+// Below this many colors a pass isn't worth a parallel region
+#define PARALLEL_SORT_MIN_COLORS 65536
+
+// Returns -1, with nothing allocated, on failure; for callers inside a parallel region, where die() can't unwind
+int color_counts_try_alloc(ColorCounts *c, size_t n) {
+    c->keys = malloc((n ? n : 1) * sizeof(uint32_t));
+    c->counts = malloc((n ? n : 1) * sizeof(uint64_t));
+    if (!c->keys || !c->counts) {
+        color_counts_free(c);
+        return -1;
+    }
+    c->size = n;
+    stats_count(&run_stats.bytes_allocated, n * (sizeof(uint32_t) + sizeof(uint64_t)));
+    return 0;
+}
+
+void color_counts_alloc(ColorCounts *c, size_t n) {
+    if (color_counts_try_alloc(c, n)) die("malloc color counts");
+}
+
+void color_counts_free(ColorCounts *c) {
+    free(c->keys);
+    free(c->counts);
+    c->keys = NULL;
+    c->counts = NULL;
+    c->size = 0;
+}
+
+// Count bytes are inverted so ascending digits give descending counts
+static inline unsigned radix_digit(const ColorCounts *c, size_t i, int pass) {
+    if (pass < KEY_PASSES) return (c->keys[i] >> (RADIX_BITS * pass)) & (RADIX_DIGITS - 1);
+    return (~c->counts[i] >> (RADIX_BITS * (pass - KEY_PASSES))) & (RADIX_DIGITS - 1);
+}
+
+// One stable counting pass from `src` into `dst`. Each thread histograms and then scatters its own
+// contiguous slice; offsets run digit-major, thread-minor, so equal digits keep their input order.
+// Returns 0, leaving `dst` untouched, when every element has the same digit.
+static int radix_pass(const ColorCounts *src, ColorCounts *dst, int pass, size_t *offsets) {
+    size_t n = src->size;
+    int moved = 0;
+
+#ifdef _OPENMP
+    #pragma omp parallel if (n >= PARALLEL_SORT_MIN_COLORS)
+#endif
+    {
+#ifdef _OPENMP
+        int t = omp_get_thread_num();
+        int team = omp_get_num_threads();
+#else
+        int t = 0;
+        int team = 1;
+#endif
+        size_t lo = n * t / team;
+        size_t hi = n * (t + 1) / team;
+        size_t *local = &offsets[(size_t)t * RADIX_DIGITS];
+
+        memset(local, 0, RADIX_DIGITS * sizeof(size_t));
+        for (size_t i = lo; i < hi; i++)
+            local[radix_digit(src, i, pass)]++;
+
+#ifdef _OPENMP
+        #pragma omp barrier
+        #pragma omp single
+#endif
+        {
+            size_t running = 0;
+            for (int d = 0; d < RADIX_DIGITS; d++) {
+                size_t total = 0;
+                for (int k = 0; k < team; k++) {
+                    size_t count = offsets[(size_t)k * RADIX_DIGITS + d];
+                    offsets[(size_t)k * RADIX_DIGITS + d] = running + total;
+                    total += count;
+                }
+                if (total == n) break;
+                if (total) moved = 1;
+                running += total;
+            }
+        }
+
+        if (moved) {
+            for (size_t i = lo; i < hi; i++) {
+                size_t j = local[radix_digit(src, i, pass)]++;
+                dst->keys[j] = src->keys[i];
+                dst->counts[j] = src->counts[i];
+            }
+        }
+    }
+    return moved;
+}
+
+// Orders by count, highest first, and equal counts by key, so the order doesn't depend on histogram
+// layout or thread count
+void sort_color_counts(ColorCounts *c) {
+    size_t n = c->size;
+    if (n < 2) return;
+
+    // Histograms usually come out key-ordered already (a dense merge always does), leaving only the count passes
+    int first_pass = KEY_PASSES;
+    for (size_t i = 1; i < n; i++) {
+        if (c->keys[i] < c->keys[i - 1]) {
+            first_pass = 0;
+            break;
+        }
+    }
+
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+#endif
+    size_t *offsets = malloc((size_t)max_threads * RADIX_DIGITS * sizeof(size_t));
+    ColorCounts scratch;
+    if (!offsets || color_counts_try_alloc(&scratch, n)) {
+        free(offsets);
+        die("malloc radix scratch");
+    }
+
+    ColorCounts *src = c, *dst = &scratch;
+    for (int pass = first_pass; pass < NUM_PASSES; pass++) {
+        if (!radix_pass(src, dst, pass, offsets)) continue;
+        ColorCounts *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    // Copied back rather than swapped, so callers can keep reusing arrays larger than `size`
+    if (src != c) {
+        memcpy(c->keys, src->keys, n * sizeof(uint32_t));
+        memcpy(c->counts, src->counts, n * sizeof(uint64_t));
+    }
+    color_counts_free(&scratch);
+    free(offsets);
+}
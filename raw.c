@@ -0,0 +1,171 @@
+#define _POSIX_C_SOURCE 200809L
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Output bytes packed per block before each write; blocks hold whole rows of tiles, so the bytes don't depend on it
+#define RAW_BLOCK_BYTES (4 << 20)
+// Rows per writev call, below any platform's IOV_MAX
+#define RAW_IOV_BATCH 512
+#define RAW_TILE_SIZE 8
+
+// -bpp, or the fewest bits that index the palette; linear rows only pack 1, 2, 4 or 8 bits evenly.
+// -n and -P are checked against -bpp up front, so a palette that doesn't fit is a bug here
+int raw_bits_per_pixel(int pal_size, const PaletteConfig *config) {
+    int bits = config->raw_bpp;
+    if (!bits) {
+        if (config->raw_format == RAW_LINEAR) return png_index_bit_depth(pal_size);
+        for (bits = 1; (1 << bits) < pal_size; bits++)
+            ;
+        return bits;
+    }
+    if (pal_size > 1 << bits) {
+        fprintf(stderr, "%d colors need more than -bpp %d; raise -bpp or lower -n\n", pal_size, bits);
+        die("raw bits per pixel");
+    }
+    return bits;
+}
+
+static void raw_write_failed(const char *path) {
+    fprintf(stderr, "Failed to write to file: %s\n", path);
+    die("write raw output");
+}
+
+// Writes every buffer of `iov`, resuming after short writes; the entries are consumed in place
+static int writev_full(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t put = writev(fd, iov, n);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return -1;
+        while (n > 0 && (size_t)put >= iov->iov_len) {
+            put -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + put;
+            iov->iov_len -= put;
+        }
+    }
+    return 0;
+}
+
+// At 8 bits the index rows already are the output, so they go out as they are, many rows per call
+static int write_index_rows(int fd, png_bytep *index_rows, int w, int h) {
+    struct iovec iov[RAW_IOV_BATCH];
+    for (int y = 0; y < h; y += RAW_IOV_BATCH) {
+        int n = h - y < RAW_IOV_BATCH ? h - y : RAW_IOV_BATCH;
+        for (int k = 0; k < n; k++) {
+            iov[k].iov_base = index_rows[y + k];
+            iov[k].iov_len = w;
+        }
+        if (writev_full(fd, iov, n)) return -1;
+    }
+    return 0;
+}
+
+static int write_linear(int fd, png_bytep *index_rows, int w, int h, int bits) {
+    if (bits == 8) return write_index_rows(fd, index_rows, w, h);
+
+    size_t row_bytes = ((size_t)w * bits + 7) / 8;
+    int block_rows = RAW_BLOCK_BYTES / row_bytes;
+    if (block_rows < 1) block_rows = 1;
+    if (block_rows > h) block_rows = h;
+    png_bytep block = malloc((size_t)block_rows * row_bytes);
+    if (!block) die("malloc raw block");
+
+    int failed = 0;
+    for (int y = 0; y < h && !failed; y += block_rows) {
+        int n = h - y < block_rows ? h - y : block_rows;
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, DYNAMIC_CHUNK_SIZE)
+#endif
+        for (int k = 0; k < n; k++)
+            pack_row(index_rows[y + k], block + k * row_bytes, w, bits);
+        failed = write_full(fd, block, n * row_bytes);
+    }
+    free(block);
+    return failed;
+}
+
+// One 8x8 tile with the leftmost pixel in the high bit. Tiles past the right or bottom edge are padded with
+// index 0. RAW_PLANAR stores the 8 rows of each plane in turn (NES-style); RAW_INTERLEAVED stores planes in
+// pairs, alternating their bytes row by row (SNES, Game Boy and PC Engine tiles)
+static void encode_tile(png_bytep *index_rows, int w, int h, int tx, int ty, int bits, RawFormat format,
+                        png_bytep out) {
+    uint8_t planes[8][RAW_TILE_SIZE];
+    memset(planes, 0, sizeof(planes));
+    int x0 = tx * RAW_TILE_SIZE, y0 = ty * RAW_TILE_SIZE;
+    int tw = w - x0 < RAW_TILE_SIZE ? w - x0 : RAW_TILE_SIZE;
+    int th = h - y0 < RAW_TILE_SIZE ? h - y0 : RAW_TILE_SIZE;
+    for (int y = 0; y < th; y++) {
+        png_const_bytep row = index_rows[y0 + y] + x0;
+        for (int x = 0; x < tw; x++) {
+            for (int p = 0; p < bits; p++)
+                planes[p][y] |= ((row[x] >> p) & 1) << (RAW_TILE_SIZE - 1 - x);
+        }
+    }
+
+    if (format == RAW_PLANAR) {
+        for (int p = 0; p < bits; p++, out += RAW_TILE_SIZE)
+            memcpy(out, planes[p], RAW_TILE_SIZE);
+        return;
+    }
+    // An odd last plane has no partner and takes one byte per row
+    for (int p = 0; p < bits; p += 2) {
+        for (int y = 0; y < RAW_TILE_SIZE; y++) {
+            *out++ = planes[p][y];
+            if (p + 1 < bits) *out++ = planes[p + 1][y];
+        }
+    }
+}
+
+static int write_tiles(int fd, png_bytep *index_rows, int w, int h, int bits, RawFormat format) {
+    int tiles_x = (w + RAW_TILE_SIZE - 1) / RAW_TILE_SIZE;
+    int tiles_y = (h + RAW_TILE_SIZE - 1) / RAW_TILE_SIZE;
+    size_t tile_bytes = (size_t)RAW_TILE_SIZE * bits;
+    size_t tile_row_bytes = tiles_x * tile_bytes;
+    int block_tile_rows = RAW_BLOCK_BYTES / tile_row_bytes;
+    if (block_tile_rows < 1) block_tile_rows = 1;
+    if (block_tile_rows > tiles_y) block_tile_rows = tiles_y;
+    png_bytep block = malloc(block_tile_rows * tile_row_bytes);
+    if (!block) die("malloc raw block");
+
+    int failed = 0;
+    for (int ty = 0; ty < tiles_y && !failed; ty += block_tile_rows) {
+        int n = tiles_y - ty < block_tile_rows ? tiles_y - ty : block_tile_rows;
+        int num_tiles = n * tiles_x;
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic, DYNAMIC_CHUNK_SIZE)
+#endif
+        for (int t = 0; t < num_tiles; t++)
+            encode_tile(index_rows, w, h, t % tiles_x, ty + t / tiles_x, bits, format, block + t * tile_bytes);
+        failed = write_full(fd, block, num_tiles * tile_bytes);
+    }
+    free(block);
+    return failed;
+}
+
+// Headerless index data in `path`, tiles left to right then top to bottom, and the raw palette in path.pal.bin
+void write_raw_output(const char *path, int w, int h, Color *palette, int pal_size,
+                      png_bytep *index_rows, const PaletteConfig *config) {
+    int bits = raw_bits_per_pixel(pal_size, config);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open output file: %s\n", path);
+        die("open output");
+    }
+    int failed = config->raw_format == RAW_LINEAR ? write_linear(fd, index_rows, w, h, bits)
+                                                  : write_tiles(fd, index_rows, w, h, bits, config->raw_format);
+    if (close(fd) || failed) raw_write_failed(path);
+
+    size_t len = strlen(path);
+    char *pal_path = malloc(len + sizeof(".pal.bin"));
+    if (!pal_path) die("malloc palette path");
+    memcpy(pal_path, path, len);
+    memcpy(pal_path + len, ".pal.bin", sizeof(".pal.bin"));
+    write_raw_palette(pal_path, palette, pal_size, config);
+    free(pal_path);
+}
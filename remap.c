@@ -0,0 +1,371 @@
+#define _POSIX_C_SOURCE 200809L
+#include "utils.h"
+#include <sched.h>
+
+// Columns an error-diffusion row finishes before publishing its progress to the row below
+#define DITHER_BLOCK 64
+// Polls of the row above before a waiting thread yields its core, so a team larger than the free cores
+// doesn't spend whole time slices spinning while the row it waits for can't run
+#define DITHER_SPIN_LIMIT 256
+
+static const uint8_t bayer8[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+void inverse_colormap_init(InverseColormap *map, int bit_depth, const Color *palette, int pal_size, size_t num_pixels) {
+    map->bit_depth = bit_depth;
+    map->table = NULL;
+    palette_soa_init(&map->soa, palette, pal_size);
+
+    // A full table only pays off when there are at least as many pixels as possible colors
+    size_t nbins = (size_t)1 << (3 * bit_depth);
+    if (bit_depth > DENSE_HISTOGRAM_MAX_DEPTH || nbins > num_pixels) return;
+
+    map->table = malloc(nbins);
+    if (!map->table) die("malloc inverse colormap");
+    stats_count(&run_stats.bytes_allocated, nbins);
+    stats_count(&run_stats.distance_evals, (uint64_t)nbins * pal_size);
+    int mask = (1 << bit_depth) - 1;
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for (int i = 0; i < (int)nbins; i++) {
+        map->table[i] = map->soa.kernels->nearest(&map->soa, i >> (2 * bit_depth), (i >> bit_depth) & mask,
+                                                  i & mask, NULL);
+    }
+}
+
+void inverse_colormap_free(InverseColormap *map) {
+    free(map->table);
+    map->table = NULL;
+    palette_soa_free(&map->soa);
+}
+
+// Direct-mapped caches of recent lookups, one per thread of the coming parallel region; count holds the
+// palette index. Allocated before the region, so a failure is reported on the calling thread; a team size
+// of 0 means the default team.
+static ColorBucket* alloc_lookup_caches(const InverseColormap *map, int num_threads) {
+    if (map->table) return NULL;
+#ifdef _OPENMP
+    if (num_threads <= 0) num_threads = omp_get_max_threads();
+#else
+    num_threads = 1;
+#endif
+    size_t size = (size_t)num_threads * INVERSE_CACHE_SIZE * sizeof(ColorBucket);
+    ColorBucket *caches = malloc(size);
+    if (!caches) die("malloc inverse cache");
+    stats_count(&run_stats.bytes_allocated, size);
+    return caches;
+}
+
+// This thread's cache, cleared; each thread touches its own first
+static ColorBucket* thread_lookup_cache(ColorBucket *caches) {
+    if (!caches) return NULL;
+#ifdef _OPENMP
+    ColorBucket *cache = &caches[(size_t)omp_get_thread_num() * INVERSE_CACHE_SIZE];
+#else
+    ColorBucket *cache = caches;
+#endif
+    memset(cache, 0xFF, INVERSE_CACHE_SIZE * sizeof(ColorBucket));
+    return cache;
+}
+
+// Palette index for a color at the logical depth
+static inline int lookup_index(const InverseColormap *map, ColorBucket *cache, int r, int g, int b, uint64_t *misses) {
+    int bit_depth = map->bit_depth;
+    if (map->table) return map->table[(r << (2 * bit_depth)) | (g << bit_depth) | b];
+
+    uint32_t key = ((uint32_t)r << 16) | ((uint32_t)g << 8) | (uint32_t)b;
+    ColorBucket *slot = &cache[hash_key(key) & (INVERSE_CACHE_SIZE - 1)];
+    if (slot->key != key) {
+        (*misses)++;
+        slot->key = key;
+        slot->count = map->soa.kernels->nearest(&map->soa, r, g, b, NULL);
+    }
+    return slot->count;
+}
+
+KERNEL_INLINE void table_remap_row(const uint8_t *table, png_const_bytep row, png_bytep out, int w,
+                                   int bit_depth, int channels) {
+    int shift = 8 - bit_depth;
+    for (int x = 0; x < w; x++) {
+        png_const_bytep px = &row[x * channels];
+        out[x] = table[((px[0] >> shift) << (2 * bit_depth)) | ((px[1] >> shift) << bit_depth) | (px[2] >> shift)];
+    }
+}
+
+KERNEL_INLINE void cached_remap_row(const InverseColormap *map, ColorBucket *cache, png_const_bytep row, png_bytep out,
+                                    int w, uint64_t *misses, int bit_depth, int channels) {
+    int shift = 8 - bit_depth;
+    for (int x = 0; x < w; x++) {
+        png_const_bytep px = &row[x * channels];
+        out[x] = lookup_index(map, cache, px[0] >> shift, px[1] >> shift, px[2] >> shift, misses);
+    }
+}
+
+typedef void (*TableRemapFn)(const uint8_t *table, png_const_bytep row, png_bytep out, int w);
+typedef void (*CachedRemapFn)(const InverseColormap *map, ColorBucket *cache, png_const_bytep row, png_bytep out,
+                              int w, uint64_t *misses);
+
+#define REMAP_ROW_KERNELS(D, C) \
+    static void table_remap_row_##D##_##C(const uint8_t *table, png_const_bytep row, png_bytep out, int w) { \
+        table_remap_row(table, row, out, w, D, C); \
+    } \
+    static void cached_remap_row_##D##_##C(const InverseColormap *map, ColorBucket *cache, png_const_bytep row, \
+                                          png_bytep out, int w, uint64_t *misses) { \
+        cached_remap_row(map, cache, row, out, w, misses, D, C); \
+    }
+FOR_EACH_PIXEL_FORMAT(REMAP_ROW_KERNELS)
+
+#define TABLE_REMAP_ENTRY(D, C) [PIXEL_FORMAT_INDEX(D, C)] = table_remap_row_##D##_##C,
+#define CACHED_REMAP_ENTRY(D, C) [PIXEL_FORMAT_INDEX(D, C)] = cached_remap_row_##D##_##C,
+static const TableRemapFn table_remap_kernels[NUM_PIXEL_FORMATS] = { FOR_EACH_PIXEL_FORMAT(TABLE_REMAP_ENTRY) };
+static const CachedRemapFn cached_remap_kernels[NUM_PIXEL_FORMATS] = { FOR_EACH_PIXEL_FORMAT(CACHED_REMAP_ENTRY) };
+
+void remap_rows(const InverseColormap *map, png_bytep *rows, png_bytep *out_rows, int w, int h, int channels) {
+    int format = pixel_format_index(map->bit_depth, channels);
+    TableRemapFn table_kernel = table_remap_kernels[format];
+    CachedRemapFn cached_kernel = cached_remap_kernels[format];
+
+    ColorBucket *caches = alloc_lookup_caches(map, 0);
+
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        ColorBucket *cache = thread_lookup_cache(caches);
+        uint64_t misses = 0;
+
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, DYNAMIC_CHUNK_SIZE)
+#endif
+        for (int y = 0; y < h; y++) {
+            if (map->table)
+                table_kernel(map->table, rows[y], out_rows[y], w);
+            else
+                cached_kernel(map, cache, rows[y], out_rows[y], w, &misses);
+        }
+
+        stats_count(&run_stats.distance_evals, misses * map->soa.size);
+    }
+    free(caches);
+}
+
+png_bytep* quantize_image(png_bytep *rows, int w, int h, int channels, int bit_depth, Color *palette, int pal_size) {
+    png_bytep *out_rows = alloc_rows(h, w);
+
+    InverseColormap map;
+    inverse_colormap_init(&map, bit_depth, palette, pal_size, (size_t)w * h);
+    remap_rows(&map, rows, out_rows, w, h, channels);
+    inverse_colormap_free(&map);
+
+    return out_rows;
+}
+
+static inline int clamp8(int v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+void dither_init(Dither *d, const InverseColormap *map, DitherMode mode, int w) {
+    memset(d, 0, sizeof(*d));
+    d->mode = mode;
+    d->w = w;
+    if (mode == DITHER_NONE) return;
+
+    // Palette colors at 8 bits, the precision errors are measured in
+    int max_value = (1 << map->bit_depth) - 1;
+    size_t n = map->soa.size;
+    d->palette8 = malloc(3 * n * sizeof(int16_t));
+    if (!d->palette8) die("malloc dither palette");
+    for (size_t i = 0; i < n; i++) {
+        d->palette8[3 * i] = (map->soa.r[i] * 255 + max_value / 2) / max_value;
+        d->palette8[3 * i + 1] = (map->soa.g[i] * 255 + max_value / 2) / max_value;
+        d->palette8[3 * i + 2] = (map->soa.b[i] * 255 + max_value / 2) / max_value;
+    }
+
+    if (mode == DITHER_ORDERED) {
+        // Offsets span roughly the spacing of a palette spread evenly over the color cube
+        int side = 1;
+        while ((size_t)(side + 1) * (side + 1) * (side + 1) <= n) side++;
+        int spread = 255 / side;
+        for (int i = 0; i < 64; i++)
+            d->thresholds[i] = (int16_t)(((2 * bayer8[i / 8][i % 8] + 1 - 64) * spread) / 128);
+        return;
+    }
+
+    // A ring of error rows: a row can only start once the row `ring - 1` above it is done,
+    // which schedule(static, 1) guarantees for teams of up to ring - 2 threads
+#ifdef _OPENMP
+    d->ring = omp_get_max_threads() + 2;
+#else
+    d->ring = 2;
+#endif
+    size_t row_errors = 3 * ((size_t)w + 2);
+    d->errors = calloc(d->ring * row_errors, sizeof(int32_t));
+    d->progress = calloc(d->ring, sizeof(int64_t));
+    if (!d->errors || !d->progress) die("malloc dither state");
+    stats_count(&run_stats.bytes_allocated, d->ring * (row_errors * sizeof(int32_t) + sizeof(int64_t)));
+}
+
+void dither_free(Dither *d) {
+    free(d->palette8);
+    free(d->errors);
+    free(d->progress);
+}
+
+static void dither_ordered_rows(Dither *d, const InverseColormap *map, png_bytep *rows, png_bytep *out_rows,
+                                int n, int channels) {
+    int shift = 8 - map->bit_depth;
+    int y0 = d->next_row;
+
+    ColorBucket *caches = alloc_lookup_caches(map, 0);
+
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        ColorBucket *cache = thread_lookup_cache(caches);
+        uint64_t misses = 0;
+
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, DYNAMIC_CHUNK_SIZE)
+#endif
+        for (int y = 0; y < n; y++) {
+            const int16_t *t = &d->thresholds[((y0 + y) & 7) * 8];
+            png_bytep row = rows[y];
+            png_bytep out = out_rows[y];
+            for (int x = 0; x < d->w; x++) {
+                png_bytep px = &row[x * channels];
+                int offset = t[x & 7];
+                out[x] = lookup_index(map, cache, clamp8(px[0] + offset) >> shift, clamp8(px[1] + offset) >> shift,
+                                      clamp8(px[2] + offset) >> shift, &misses);
+            }
+        }
+
+        stats_count(&run_stats.distance_evals, misses * map->soa.size);
+    }
+    free(caches);
+}
+
+// Floyd-Steinberg as a wavefront: each thread takes whole rows, and a row only consumes a block of
+// columns once the row above has finished the columns whose error lands there. The arithmetic per
+// pixel is the same as a serial scan, so the output doesn't depend on the thread count.
+static void dither_diffuse_rows(Dither *d, const InverseColormap *map, png_bytep *rows, png_bytep *out_rows,
+                                int n, int channels) {
+    int shift = 8 - map->bit_depth;
+    int w = d->w;
+    int y0 = d->next_row;
+    size_t row_errors = 3 * ((size_t)w + 2);
+    const int16_t *palette8 = d->palette8;
+
+    ColorBucket *caches = alloc_lookup_caches(map, d->ring - 2);
+
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(d->ring - 2)
+#endif
+    {
+        ColorBucket *cache = thread_lookup_cache(caches);
+        uint64_t misses = 0;
+
+#ifdef _OPENMP
+        #pragma omp for schedule(static, 1)
+#endif
+        for (int y = 0; y < n; y++) {
+            int abs_y = y0 + y;
+            int slot = abs_y % d->ring;
+            int next_slot = (abs_y + 1) % d->ring;
+            // Error rows are offset by one column so the store for x - 1 never leaves the row
+            int32_t *in_err = &d->errors[slot * row_errors + 3];
+            int32_t *out_err = &d->errors[next_slot * row_errors + 3];
+            // Progress counts columns over the whole image, so a slot's stale value from an older row never passes
+            int64_t *above = &d->progress[(abs_y + d->ring - 1) % d->ring];
+            int64_t row_start = (int64_t)abs_y * (w + 1);
+
+            png_bytep row = rows[y];
+            png_bytep out = out_rows[y];
+            // Error in sixteenths headed right, and the running sums for the two columns below not yet stored
+            int carry_r = 0, carry_g = 0, carry_b = 0;
+            int left_r = 0, left_g = 0, left_b = 0;
+            int mid_r = 0, mid_g = 0, mid_b = 0;
+
+            for (int x0 = 0; x0 < w; x0 += DITHER_BLOCK) {
+                int x1 = x0 + DITHER_BLOCK < w ? x0 + DITHER_BLOCK : w;
+                int64_t needed = row_start - (w + 1) + (x1 + 1 < w ? x1 + 1 : w);
+                if (abs_y > 0) {
+                    int64_t done;
+                    for (int spins = 0;; spins++) {
+#ifdef _OPENMP
+                        #pragma omp atomic read
+#endif
+                        done = *above;
+                        if (done >= needed) break;
+                        if (spins >= DITHER_SPIN_LIMIT) sched_yield();
+                    }
+#ifdef _OPENMP
+                    #pragma omp flush
+#endif
+                }
+
+                for (int x = x0; x < x1; x++) {
+                    png_bytep px = &row[x * channels];
+                    const int32_t *e = &in_err[3 * x];
+                    int r = clamp8(px[0] + ((e[0] + carry_r + 8) >> 4));
+                    int g = clamp8(px[1] + ((e[1] + carry_g + 8) >> 4));
+                    int b = clamp8(px[2] + ((e[2] + carry_b + 8) >> 4));
+                    int idx = lookup_index(map, cache, r >> shift, g >> shift, b >> shift, &misses);
+                    out[x] = idx;
+
+                    const int16_t *p = &palette8[3 * idx];
+                    int err_r = r - p[0], err_g = g - p[1], err_b = b - p[2];
+                    carry_r = 7 * err_r;
+                    carry_g = 7 * err_g;
+                    carry_b = 7 * err_b;
+                    // Column x - 1 below is complete once this pixel adds its 3/16
+                    int32_t *below = &out_err[3 * (x - 1)];
+                    below[0] = left_r + 3 * err_r;
+                    below[1] = left_g + 3 * err_g;
+                    below[2] = left_b + 3 * err_b;
+                    left_r = mid_r + 5 * err_r;
+                    left_g = mid_g + 5 * err_g;
+                    left_b = mid_b + 5 * err_b;
+                    mid_r = err_r;
+                    mid_g = err_g;
+                    mid_b = err_b;
+                }
+                if (x1 == w) {
+                    out_err[3 * (w - 1)] = left_r;
+                    out_err[3 * (w - 1) + 1] = left_g;
+                    out_err[3 * (w - 1) + 2] = left_b;
+                }
+
+#ifdef _OPENMP
+                #pragma omp flush
+                #pragma omp atomic write
+#endif
+                d->progress[slot] = row_start + x1;
+            }
+        }
+
+        stats_count(&run_stats.distance_evals, misses * map->soa.size);
+    }
+    free(caches);
+}
+
+// Remaps `n` consecutive rows; successive calls continue the same image, so strips dither seamlessly
+void dither_rows(Dither *d, const InverseColormap *map, png_bytep *rows, png_bytep *out_rows, int n, int channels) {
+    if (d->mode == DITHER_ORDERED)
+        dither_ordered_rows(d, map, rows, out_rows, n, channels);
+    else if (d->mode == DITHER_FLOYD_STEINBERG)
+        dither_diffuse_rows(d, map, rows, out_rows, n, channels);
+    else
+        remap_rows(map, rows, out_rows, d->w, n, channels);
+    d->next_row += n;
+}
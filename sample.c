@@ -0,0 +1,166 @@
+#include "utils.h"
+
+// Fixed, so a sampled run picks the same pixels every time
+#define SAMPLE_SEED 0x5eed5eedu
+
+// A fraction within about 2^-31 of 1 rounds to a rate of 1 and counts every pixel
+void sampler_init(Sampler *s, const PaletteConfig *config) {
+    s->active = 0;
+    s->rate = 0;
+    s->stratified = config->sample_mode == SAMPLE_STRATIFIED;
+    if (config->sample_fraction <= 0 || config->sample_fraction >= 1) return;
+    // The smallest rate whose square reaches the fraction, so a fraction of 1 / n^2 gives cells of exactly
+    // n, as an integer step would. Found bit by bit rather than with sqrt, which keeps libm out of the library.
+    double target = config->sample_fraction * 18446744073709551616.0;
+    uint64_t below = 0;
+    for (uint64_t bit = (uint64_t)1 << 31; bit; bit >>= 1) {
+        double r = (double)(below | bit);
+        if (r * r < target) below |= bit;
+    }
+    if (below + 1 > UINT32_MAX) return;
+    s->active = 1;
+    s->rate = (uint32_t)(below + 1);
+}
+
+// The kept fraction of the pixels, up to rounding at the right and bottom edges
+double sampler_fraction(const Sampler *s) {
+    if (!s->active) return 1.0;
+    double rate = s->rate / 4294967296.0;
+    return rate * rate;
+}
+
+// Band or cell k covers rows or columns cell_start(k) .. cell_start(k + 1) - 1
+static int cell_of(const Sampler *s, int x) {
+    return (int)(((uint64_t)x * s->rate) >> 32);
+}
+
+static int cell_start(const Sampler *s, int k) {
+    return (int)((((uint64_t)k << 32) + s->rate - 1) / s->rate);
+}
+
+// How many pixels sampler_gather takes from a row of w
+int sampler_columns(const Sampler *s, int w) {
+    return w > 0 ? cell_of(s, w - 1) + 1 : 0;
+}
+
+// Position within a band or cell of `span` pixels: the first one, or a seeded random one
+static int sample_offset(const Sampler *s, uint32_t a, uint32_t b, int span) {
+    if (!s->stratified || span <= 1) return 0;
+    return hash_key(hash_key(a ^ SAMPLE_SEED) ^ b) % span;
+}
+
+int sampler_takes_row(const Sampler *s, int y, int h) {
+    int band = cell_of(s, y);
+    int first = cell_start(s, band);
+    int next = cell_start(s, band + 1);
+    int span = (next < h ? next : h) - first;
+    return y == first + sample_offset(s, band, UINT32_MAX, span);
+}
+
+// Copies one pixel per cell of the row into `out`; returns how many
+int sampler_gather(const Sampler *s, png_const_bytep row, int y, int w, int channels, png_bytep out) {
+    int n = 0;
+    for (int x0 = 0; x0 < w; n++) {
+        int next = cell_start(s, n + 1);
+        int span = (next < w ? next : w) - x0;
+        int x = x0 + sample_offset(s, y, n, span);
+        memcpy(&out[n * channels], &row[x * channels], channels);
+        x0 = next;
+    }
+    return n;
+}
+
+// Draws 32 * words fair coin flips seeded by `key`; returns how many came up heads
+static uint64_t coin_flips(uint32_t key, uint64_t flips) {
+    uint64_t heads = 0;
+    for (uint64_t done = 0; done < flips; done += 32) {
+        uint32_t bits = hash_key(hash_key(key ^ SAMPLE_SEED) + (uint32_t)done);
+        if (flips - done < 32) bits &= (1u << (flips - done)) - 1;
+        heads += __builtin_popcount(bits);
+    }
+    return heads;
+}
+
+static uint64_t isqrt(uint64_t v) {
+    uint64_t r = 0;
+    for (uint64_t bit = (uint64_t)1 << 62; bit; bit >>= 2) {
+        if (v >= r + bit) {
+            v -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+    }
+    return r;
+}
+
+// Keeps each counted pixel with probability 1/2, as if only half the samples had been drawn. Counts
+// above THIN_EXACT_MAX flip THIN_EXACT_MAX coins and scale the deviation, which keeps the spread.
+#define THIN_EXACT_MAX 4096
+static void thin_half(const ColorCounts *colors, ColorCounts *half) {
+    color_counts_alloc(half, colors->size);
+    size_t kept = 0;
+    for (size_t i = 0; i < colors->size; i++) {
+        uint64_t n = colors->counts[i];
+        uint64_t count;
+        if (n <= THIN_EXACT_MAX) {
+            count = coin_flips(colors->keys[i], n);
+        } else {
+            int64_t deviation = (int64_t)coin_flips(colors->keys[i], THIN_EXACT_MAX) - THIN_EXACT_MAX / 2;
+            count = n / 2 + deviation * (int64_t)isqrt(n / THIN_EXACT_MAX);
+        }
+        if (count) {
+            half->keys[kept] = colors->keys[i];
+            half->counts[kept++] = count;
+        }
+    }
+    half->size = kept;
+}
+
+// Sampling error shrinks with the square root of the sample count, so a palette built from half the
+// sample differs from the full-sample palette by about as much as that one differs from the palette
+// of every pixel. The difference is the mean and maximum distance, summed over channels at the
+// logical depth, from each entry to the closest entry of the other palette.
+void report_sample_error(const ColorCounts *colors, const Color *palette, int pal_size, const PaletteConfig *config) {
+    Sampler sampler;
+    sampler_init(&sampler, config);
+    if (!sampler.active || (!config->verbose && !config->stats_path)) return;
+
+    ColorCounts half;
+    thin_half(colors, &half);
+    if (half.size == 0) {
+        color_counts_free(&half);
+        return;
+    }
+    PaletteConfig quiet = *config;
+    quiet.verbose = 0;
+    int half_size;
+    Color *half_palette = build_palette(&half, &quiet, &half_size);
+    color_counts_free(&half);
+
+    double sum = 0;
+    int max = 0;
+    for (int i = 0; i < pal_size; i++) {
+        int best = INT32_MAX;
+        for (int j = 0; j < half_size; j++) {
+            int d = abs(palette[i].r - half_palette[j].r) + abs(palette[i].g - half_palette[j].g)
+                  + abs(palette[i].b - half_palette[j].b);
+            if (d < best) best = d;
+        }
+        sum += best;
+        if (best > max) max = best;
+    }
+    free(half_palette);
+    double mean = pal_size ? sum / pal_size : 0.0;
+
+#ifdef _OPENMP
+    #pragma omp critical(sample_error)
+#endif
+    if (mean > run_stats.sample_palette_error) run_stats.sample_palette_error = mean;
+
+    if (config->verbose) {
+        fprintf(stderr, "sampled %.2f%% of pixels (%s); estimated palette error vs. all pixels: "
+                        "mean %.2f, max %d (at %d bits)\n", 100.0 * sampler_fraction(&sampler),
+                config->sample_mode == SAMPLE_STRATIFIED ? "stratified" : "strided", mean, max, config->bit_depth);
+    }
+}
@@ -0,0 +1,91 @@
+#define _POSIX_C_SOURCE 200809L
+#include "utils.h"
+#include <time.h>
+
+RunStats run_stats;
+
+static const char *stage_names[NUM_STAGES] = { "decode", "histogram", "palette", "remap", "encode" };
+
+static double cpu_seconds(int thread_cpu) {
+    struct timespec ts;
+    clock_gettime(thread_cpu ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// A batch worker only counts its own thread's CPU, or every stage would include the other workers' files;
+// a single image at the top level counts the whole process, including the threads its stages fork
+StageTimer stage_start(void) {
+    StageTimer t;
+#ifdef _OPENMP
+    t.thread_cpu = omp_in_parallel();
+#else
+    t.thread_cpu = 0;
+#endif
+    t.wall = wall_seconds();
+    t.cpu = cpu_seconds(t.thread_cpu);
+    return t;
+}
+
+void stage_stop(Stage stage, StageTimer t) {
+    double wall = wall_seconds() - t.wall;
+    double cpu = cpu_seconds(t.thread_cpu) - t.cpu;
+#ifdef _OPENMP
+    #pragma omp atomic
+#endif
+    run_stats.wall[stage] += wall;
+#ifdef _OPENMP
+    #pragma omp atomic
+#endif
+    run_stats.cpu[stage] += cpu;
+}
+
+void stats_count(uint64_t *counter, uint64_t n) {
+#ifdef _OPENMP
+    #pragma omp atomic
+#endif
+    *counter += n;
+}
+
+static void write_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+void write_run_stats(const char *path, const char *tool, const JobList *jobs, int num_threads, double elapsed) {
+    FILE *out = strcmp(path, "-") ? fopen(path, "a") : stderr;
+    if (!out) {
+        fprintf(stderr, "Failed to open stats file: %s\n", path);
+        die("open stats");
+    }
+
+    fprintf(out, "{\"tool\": ");
+    write_json_string(out, tool);
+    fprintf(out, ", \"jobs\": %d", jobs->count);
+    if (jobs->count == 1) {
+        fprintf(out, ", \"input\": ");
+        write_json_string(out, jobs->jobs[0].in_path);
+        fprintf(out, ", \"output\": ");
+        write_json_string(out, jobs->jobs[0].out_path);
+    }
+    fprintf(out, ", \"threads\": %d, \"wall_s\": %.6f, \"stages\": {", num_threads, elapsed);
+    for (int s = 0; s < NUM_STAGES; s++) {
+        fprintf(out, "%s\"%s\": {\"wall_s\": %.6f, \"cpu_s\": %.6f}",
+                s ? ", " : "", stage_names[s], run_stats.wall[s], run_stats.cpu[s]);
+    }
+    fprintf(out, "}, \"unique_colors\": %llu, \"hash_probes\": %llu, \"greedy_iterations\": %llu, "
+                 "\"kmeans_iterations\": %llu, \"distance_evals\": %llu, \"bytes_allocated\": %llu, \"sampled_pixels\": %llu, "
+                 "\"sample_palette_error\": %.3f, \"reused_strips\": %llu, \"peak_rss_kib\": %ld}\n",
+            (unsigned long long)run_stats.unique_colors, (unsigned long long)run_stats.hash_probes,
+            (unsigned long long)run_stats.greedy_iterations, (unsigned long long)run_stats.kmeans_iterations,
+            (unsigned long long)run_stats.distance_evals,
+            (unsigned long long)run_stats.bytes_allocated, (unsigned long long)run_stats.sampled_pixels,
+            run_stats.sample_palette_error, (unsigned long long)run_stats.reused_strips, peak_rss_kib());
+
+    if (out != stderr) fclose(out);
+}
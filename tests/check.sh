@@ -0,0 +1,59 @@
+#!/bin/sh
+# Runs both tools on example.png with several settings, single- and multi-threaded, and compares
+# png_to_jasc's palette, quantize_png's decoded palette and indices, and checksums of its -raw linear
+# output with tests/expected. The expected files come from the greedy loop that recomputed every
+# candidate's distance to the whole palette, so a mismatch means palette selection or remapping changed.
+cd "$(dirname "$0")/.." || exit 1
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+fail=0
+check() {
+    if ! cmp -s "$1" "$2"; then
+        echo "FAIL: $3"
+        fail=1
+    fi
+}
+
+while read -r name opts; do
+    tests/pngdump "tests/expected/$name.png" > "$tmp/$name.expected"
+    for threads in 1 4; do
+        OMP_NUM_THREADS=$threads ./png_to_jasc $opts example.png "$tmp/$name.pal" >/dev/null 2>&1
+        check "$tmp/$name.pal" "tests/expected/$name.pal" "png_to_jasc $opts ($threads threads)"
+        OMP_NUM_THREADS=$threads ./quantize_png $opts example.png "$tmp/$name.png" >/dev/null 2>&1
+        tests/pngdump "$tmp/$name.png" > "$tmp/$name.got" 2>/dev/null
+        check "$tmp/$name.got" "$tmp/$name.expected" "quantize_png $opts ($threads threads)"
+        OMP_NUM_THREADS=$threads ./quantize_png $opts -raw linear -bpp 8 example.png "$tmp/$name.raw" >/dev/null 2>&1
+        (cd "$tmp" && cksum "$name.raw" "$name.raw.pal.bin") > "$tmp/$name.cksum" 2>/dev/null
+        check "$tmp/$name.cksum" "tests/expected/$name.cksum" "quantize_png $opts -raw linear ($threads threads)"
+    done
+done <<'CASES'
+b8_n256      -b 8 -n 256
+b5_n16       -b 5 -n 16
+b4_n32_s2_p4 -b 4 -n 32 -s 2 -p 4
+b6_n64_p8    -b 6 -n 64 -p 8 -db 8
+b3_n8_s1     -b 3 -n 8 -s 1
+b8_n16_p3    -b 8 -n 16 -p 3
+b5_n200_s10  -b 5 -n 200 -s 10 -p 20
+CASES
+
+# Sub-palettes too short for -n are padded, -s slots included, so palette k starts at entry k * 16
+./png_to_jasc -b 5 -db 8 -n 16 -s 1 -t 8 example.png "$tmp/tiles.pal" >/dev/null 2>&1
+palettes=$(sed -n '1s/^TILES [0-9]* [0-9]* [0-9]* //p' "$tmp/tiles.pal.tiles")
+declared=$(sed -n 3p "$tmp/tiles.pal")
+entries=$(($(wc -l < "$tmp/tiles.pal") - 3))
+if [ -z "$palettes" ] || [ "$declared" != $((palettes * 16)) ] || [ "$entries" != "$declared" ]; then
+    echo "FAIL: png_to_jasc -n 16 -s 1 -t 8 declares $declared entries, writes $entries for ${palettes:-?} palettes"
+    fail=1
+fi
+
+# At 1 bit there are only 8 colors, so the palette is short; the raw palette is still -n entries of 2 bytes
+./quantize_png -b 1 -n 16 -s 1 -raw linear example.png "$tmp/short.raw" >/dev/null 2>&1
+size=$(wc -c < "$tmp/short.raw.pal.bin")
+if [ "$size" -ne 32 ]; then
+    echo "FAIL: quantize_png -b 1 -n 16 -s 1 -raw linear writes a $size-byte palette, expected 32"
+    fail=1
+fi
+
+[ $fail -eq 0 ] && echo "all checks passed"
+exit $fail
@@ -0,0 +1,53 @@
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Prints a palette PNG as its size, its PLTE entries and one byte per pixel index, so two encodings of
+// the same image compare equal however their rows were packed, filtered and compressed
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s image.png\n", argv[0]);
+        return 1;
+    }
+    FILE *fp = fopen(argv[1], "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open input file: %s\n", argv[1]);
+        return 1;
+    }
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png_create_info_struct(png);
+    if (!png || !info || setjmp(png_jmpbuf(png))) {
+        fprintf(stderr, "Failed to read PNG: %s\n", argv[1]);
+        return 1;
+    }
+    png_init_io(png, fp);
+    png_read_info(png, info);
+    if (png_get_color_type(png, info) != PNG_COLOR_TYPE_PALETTE) {
+        fprintf(stderr, "%s: not a palette PNG\n", argv[1]);
+        return 1;
+    }
+    png_set_packing(png);
+    png_read_update_info(png, info);
+
+    int w = png_get_image_width(png, info), h = png_get_image_height(png, info);
+    png_colorp palette;
+    int pal_size;
+    png_get_PLTE(png, info, &palette, &pal_size);
+    printf("%d %d %d\n", w, h, pal_size);
+    for (int i = 0; i < pal_size; i++)
+        printf("%d %d %d\n", palette[i].red, palette[i].green, palette[i].blue);
+
+    png_bytep row = malloc(w);
+    if (!row) {
+        perror("malloc row");
+        return 1;
+    }
+    for (int y = 0; y < h; y++) {
+        png_read_row(png, row, NULL);
+        fwrite(row, 1, w, stdout);
+    }
+    free(row);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
+    return 0;
+}
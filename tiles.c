@@ -0,0 +1,198 @@
+#include "utils.h"
+
+typedef struct {
+    uint64_t hash;
+    int tile;
+    int palette;
+} TileGroup;
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t ka = *(const uint32_t*)a, kb = *(const uint32_t*)b;
+    return (ka > kb) - (ka < kb);
+}
+
+// Colors of one tile in key order, so equal histograms produce equal arrays; `keys` and `out` hold
+// tile_size^2 entries
+static void tile_colors(const TilePalettes *tp, png_bytep *rows, int w, int h, int channels, int bit_depth,
+                        int tile, uint32_t *keys, ColorCounts *out) {
+    int shift = 8 - bit_depth;
+    int x0 = (tile % tp->tiles_x) * tp->tile_size;
+    int y0 = (tile / tp->tiles_x) * tp->tile_size;
+    int x1 = x0 + tp->tile_size < w ? x0 + tp->tile_size : w;
+    int y1 = y0 + tp->tile_size < h ? y0 + tp->tile_size : h;
+
+    size_t n = 0;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            png_bytep px = &rows[y][x * channels];
+            keys[n++] = ((uint32_t)(px[0] >> shift) << 16) | ((uint32_t)(px[1] >> shift) << 8) | (uint32_t)(px[2] >> shift);
+        }
+    }
+    qsort(keys, n, sizeof(uint32_t), cmp_u32);
+
+    size_t num_colors = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (num_colors && keys[i] == keys[i - 1]) {
+            out->counts[num_colors - 1]++;
+            continue;
+        }
+        out->keys[num_colors] = keys[i];
+        out->counts[num_colors++] = 1;
+    }
+    out->size = num_colors;
+}
+
+// FNV-1a over the key-ordered colors and counts
+static uint64_t hash_colors(const ColorCounts *colors) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < colors->size; i++) {
+        uint32_t words[2] = { colors->keys[i], (uint32_t)colors->counts[i] };
+        for (int k = 0; k < 2; k++) {
+            for (int byte = 0; byte < 4; byte++) {
+                h ^= (words[k] >> (8 * byte)) & 0xFF;
+                h *= 0x100000001b3ULL;
+            }
+        }
+    }
+    return h;
+}
+
+static int same_colors(const ColorCounts *a, const ColorCounts *b) {
+    if (a->size != b->size) return 0;
+    for (size_t i = 0; i < a->size; i++) {
+        if (a->keys[i] != b->keys[i] || a->counts[i] != b->counts[i]) return 0;
+    }
+    return 1;
+}
+
+void build_tile_palettes(TilePalettes *tp, png_bytep *rows, int w, int h, int channels, const PaletteConfig *config) {
+    int ts = config->tile_size;
+    tp->tile_size = ts;
+    tp->tiles_x = (w + ts - 1) / ts;
+    tp->tiles_y = (h + ts - 1) / ts;
+    int num_tiles = tp->tiles_x * tp->tiles_y;
+    size_t tile_pixels = (size_t)ts * ts;
+
+    // Per-tile palettes are small and numerous, so parallelism is across tiles and build_palette stays quiet
+    PaletteConfig tile_config = *config;
+    tile_config.verbose = 0;
+
+    uint64_t *hashes = malloc(num_tiles * sizeof(uint64_t));
+    tp->assignment = malloc(num_tiles * sizeof(int));
+    if (!hashes || !tp->assignment) die("malloc tile state");
+    stats_count(&run_stats.bytes_allocated, num_tiles * (sizeof(uint64_t) + sizeof(int)));
+
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        uint32_t *keys = malloc(tile_pixels * sizeof(uint32_t));
+        if (!keys) die("malloc tile scratch");
+        ColorCounts colors;
+        color_counts_alloc(&colors, tile_pixels);
+
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, DYNAMIC_CHUNK_SIZE)
+#endif
+        for (int t = 0; t < num_tiles; t++) {
+            tile_colors(tp, rows, w, h, channels, config->bit_depth, t, keys, &colors);
+            hashes[t] = hash_colors(&colors);
+        }
+
+        free(keys);
+        color_counts_free(&colors);
+    }
+
+    // Group tiles by histogram: an open-addressing table of the first tile seen with each distinct histogram.
+    // Equal hashes are confirmed against the actual colors, so a collision can't merge different tiles.
+    size_t capacity = 16;
+    while (capacity < (size_t)num_tiles * 2) capacity *= 2;
+    TileGroup *groups = malloc(capacity * sizeof(TileGroup));
+    int *representative = malloc(num_tiles * sizeof(int));
+    uint32_t *keys = malloc(tile_pixels * sizeof(uint32_t));
+    if (!groups || !representative || !keys) die("malloc tile groups");
+    ColorCounts colors, other;
+    color_counts_alloc(&colors, tile_pixels);
+    color_counts_alloc(&other, tile_pixels);
+    for (size_t i = 0; i < capacity; i++)
+        groups[i].tile = -1;
+
+    tp->num_palettes = 0;
+    for (int t = 0; t < num_tiles; t++) {
+        size_t i = hashes[t] & (capacity - 1);
+        int loaded = 0;
+        for (; groups[i].tile >= 0; i = (i + 1) & (capacity - 1)) {
+            if (groups[i].hash != hashes[t]) continue;
+            if (!loaded) {
+                tile_colors(tp, rows, w, h, channels, config->bit_depth, t, keys, &colors);
+                loaded = 1;
+            }
+            tile_colors(tp, rows, w, h, channels, config->bit_depth, groups[i].tile, keys, &other);
+            if (same_colors(&colors, &other)) break;
+        }
+        if (groups[i].tile < 0) {
+            groups[i] = (TileGroup){ hashes[t], t, tp->num_palettes };
+            representative[tp->num_palettes++] = t;
+        }
+        tp->assignment[t] = groups[i].palette;
+    }
+    free(groups);
+    free(hashes);
+    free(keys);
+    color_counts_free(&colors);
+    color_counts_free(&other);
+
+    tp->palettes = malloc(tp->num_palettes * sizeof(Color*));
+    tp->palette_sizes = malloc(tp->num_palettes * sizeof(int));
+    if (!tp->palettes || !tp->palette_sizes) die("malloc tile palettes");
+
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+        uint32_t *keys = malloc(tile_pixels * sizeof(uint32_t));
+        if (!keys) die("malloc tile scratch");
+        ColorCounts colors;
+        color_counts_alloc(&colors, tile_pixels);
+
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 1)
+#endif
+        for (int p = 0; p < tp->num_palettes; p++) {
+            tile_colors(tp, rows, w, h, channels, config->bit_depth, representative[p], keys, &colors);
+            tp->palettes[p] = build_palette(&colors, &tile_config, &tp->palette_sizes[p]);
+        }
+
+        free(keys);
+        color_counts_free(&colors);
+    }
+    free(representative);
+
+    if (config->verbose)
+        fprintf(stderr, "%d tiles of %dx%d, %d distinct sub-palettes\n", num_tiles, ts, ts, tp->num_palettes);
+}
+
+// Text layout: a header line, then one row of sub-palette indices per row of tiles
+void write_tile_assignment(const char *path, const TilePalettes *tp) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to write to file: %s\n", path);
+        die("write results");
+    }
+
+    fprintf(out, "TILES %d %d %d %d\n", tp->tile_size, tp->tiles_x, tp->tiles_y, tp->num_palettes);
+    for (int ty = 0; ty < tp->tiles_y; ty++) {
+        for (int tx = 0; tx < tp->tiles_x; tx++)
+            fprintf(out, tx ? " %d" : "%d", tp->assignment[ty * tp->tiles_x + tx]);
+        fputc('\n', out);
+    }
+    if (fclose(out)) die("write results");
+}
+
+void free_tile_palettes(TilePalettes *tp) {
+    for (int p = 0; p < tp->num_palettes; p++)
+        free(tp->palettes[p]);
+    free(tp->palettes);
+    free(tp->palette_sizes);
+    free(tp->assignment);
+}
@@ -1,18 +1,19 @@
 #include "utils.h"
+#include <sys/resource.h>
 
-static Color** allocate_local_colcounters(int num_threads, size_t **local_ncolors, size_t **local_capacities);
-static Color* merge_local_colcounters(Color **local_colcounters, size_t *local_ncolors, int num_threads, size_t *out_size);
-static png_bytep pack_row(png_bytep unpacked, int width, int bit_depth);
+static void table_free(ColorTable *t);
+static void table_grow(ColorTable *t);
+static void table_add(ColorTable *t, uint32_t key, uint64_t n);
+static void merge_dense_counts(const ColorHistogram *hist, ColorCounts *out);
+static void merge_color_tables(const ColorHistogram *hist, ColorCounts *out);
 static void png_error_fn(png_structp, png_const_charp msg);
 static void png_warning_fn(png_structp, png_const_charp msg);
-static int cmp_color(const void *a, const void *b);
-static int color_dist(const Color *a, const Color *b);
-static double min_dist(const Color *c, Color *sel, int n);
-static int find_closest_color(int r, int g, int b, Color *palette, int pal_size);
 
-void parse_arguments(int argc, char **argv, PaletteConfig *config, const char **in_path, const char **out_path) {
+void parse_arguments(int argc, char **argv, PaletteConfig *config, JobList *jobs) {
     int i = 1;
     int output_bit_depth_set = 0;
+    int kmeans_threshold_set = 0;
+    const char *manifest = NULL;
     while (i < argc && argv[i][0] == '-') {
         if (!strcmp(argv[i], "-b") && i + 1 < argc) {
             config->bit_depth = atoi(argv[++i]);
@@ -48,6 +49,102 @@ void parse_arguments(int argc, char **argv, PaletteConfig *config, const char **
                 exit(1);
             }
             output_bit_depth_set = 1;
+        } else if (!strcmp(argv[i], "-S") && i + 1 < argc) {
+            config->strip_rows = atoi(argv[++i]);
+            if (config->strip_rows < 0) {
+                fprintf(stderr, "expected strip_rows >= 0 (got %d)\n", config->strip_rows);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (!strcmp(argv[i], "-P") && i + 1 < argc) {
+            config->palette_path = argv[++i];
+        } else if (!strcmp(argv[i], "-u") && i + 1 < argc) {
+            config->shared_palette_path = argv[++i];
+        } else if (!strcmp(argv[i], "-H") && i + 1 < argc) {
+            config->histogram_path = argv[++i];
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            config->tile_size = atoi(argv[++i]);
+            if (config->tile_size < 1 || config->tile_size > MAX_TILE_SIZE) {
+                fprintf(stderr, "expected tile size [1, %d] (got %d)\n", MAX_TILE_SIZE, config->tile_size);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "-z") && i + 1 < argc) {
+            config->compression_level = atoi(argv[++i]);
+            if (config->compression_level < 0 || config->compression_level > 9) {
+                fprintf(stderr, "expected compression level [0, 9] (got %d)\n", config->compression_level);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            static const char *filter_names[] = { "none", "sub", "up", "avg", "paeth", "adaptive" };
+            const char *name = argv[++i];
+            int f;
+            for (f = FILTER_NONE; f <= FILTER_ADAPTIVE; f++)
+                if (!strcmp(name, filter_names[f])) break;
+            if (f > FILTER_ADAPTIVE) {
+                fprintf(stderr, "expected filter none, sub, up, avg, paeth or adaptive (got %s)\n", name);
+                exit(1);
+            }
+            config->png_filter = (RowFilter)f;
+        } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            const char *mode = argv[++i];
+            if (!strcmp(mode, "none")) config->dither = DITHER_NONE;
+            else if (!strcmp(mode, "fs")) config->dither = DITHER_FLOYD_STEINBERG;
+            else if (!strcmp(mode, "ordered")) config->dither = DITHER_ORDERED;
+            else {
+                fprintf(stderr, "expected dither none, fs or ordered (got %s)\n", mode);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "-sample") && i + 1 < argc) {
+            config->sample_fraction = atof(argv[++i]);
+            if (config->sample_fraction <= 0 || config->sample_fraction > 1) {
+                fprintf(stderr, "expected a sample fraction in (0, 1] (got %s)\n", argv[i]);
+                exit(1);
+            }
+            Sampler probe;
+            sampler_init(&probe, config);
+            if (config->sample_fraction < 1 && !probe.active)
+                fprintf(stderr, "warning: -sample %s rounds to 1; counting every pixel\n", argv[i]);
+        } else if (!strcmp(argv[i], "-sampling") && i + 1 < argc) {
+            const char *mode = argv[++i];
+            if (!strcmp(mode, "stratified")) config->sample_mode = SAMPLE_STRATIFIED;
+            else if (!strcmp(mode, "strided")) config->sample_mode = SAMPLE_STRIDED;
+            else {
+                fprintf(stderr, "expected sampling stratified or strided (got %s)\n", mode);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "-k") && i + 1 < argc) {
+            config->kmeans_iterations = atoi(argv[++i]);
+            if (config->kmeans_iterations < 0) {
+                fprintf(stderr, "expected k-means iterations >= 0 (got %d)\n", config->kmeans_iterations);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "-kt") && i + 1 < argc) {
+            config->kmeans_threshold = atof(argv[++i]);
+            if (config->kmeans_threshold <= 0 || config->kmeans_threshold >= 1) {
+                fprintf(stderr, "expected a k-means threshold in (0, 1) (got %s)\n", argv[i]);
+                exit(1);
+            }
+            kmeans_threshold_set = 1;
+        } else if (!strcmp(argv[i], "-raw") && i + 1 < argc) {
+            const char *format = argv[++i];
+            if (!strcmp(format, "linear")) config->raw_format = RAW_LINEAR;
+            else if (!strcmp(format, "planar")) config->raw_format = RAW_PLANAR;
+            else if (!strcmp(format, "interleaved")) config->raw_format = RAW_INTERLEAVED;
+            else {
+                fprintf(stderr, "expected raw format linear, planar or interleaved (got %s)\n", format);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "-bpp") && i + 1 < argc) {
+            config->raw_bpp = atoi(argv[++i]);
+            if (config->raw_bpp < 1 || config->raw_bpp > 8) {
+                fprintf(stderr, "expected bits per pixel [1, 8] (got %d)\n", config->raw_bpp);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "-cache")) {
+            config->incremental = 1;
+        } else if (!strcmp(argv[i], "-stats") && i + 1 < argc) {
+            config->stats_path = argv[++i];
         } else if (!strcmp(argv[i], "-v")) {
             config->verbose = 1;
         } else {
@@ -61,127 +158,120 @@ void parse_arguments(int argc, char **argv, PaletteConfig *config, const char **
         exit(1);
     }
 
-    if (argc - i != 2) {
+    if (!kmeans_threshold_set) config->kmeans_threshold = KMEANS_DEFAULT_THRESHOLD;
+
+    if (config->raw_bpp && config->raw_format == RAW_NONE) {
+        fprintf(stderr, "-bpp requires -raw\n");
+        exit(1);
+    }
+    if (config->raw_format == RAW_LINEAR && config->raw_bpp && 8 % config->raw_bpp) {
+        fprintf(stderr, "-raw linear packs 1, 2, 4 or 8 bits per pixel (got %d)\n", config->raw_bpp);
+        exit(1);
+    }
+    // Checked before any image is read, so a batch can't stop halfway; a -P palette is checked once it is loaded
+    if (config->raw_bpp && !config->palette_path && config->max_colors > 1 << config->raw_bpp) {
+        fprintf(stderr, "-n %d needs more than -bpp %d; raise -bpp or lower -n\n", config->max_colors, config->raw_bpp);
+        exit(1);
+    }
+
+    if (config->histogram_path && !config->shared_palette_path) {
+        fprintf(stderr, "-H requires -u palette.pal\n");
+        exit(1);
+    }
+
+    int npaths = argc - i;
+    int usage_error;
+    if (config->shared_palette_path)
+        usage_error = manifest || npaths < (config->histogram_path ? 0 : 1);
+    else
+        usage_error = manifest ? npaths != 0 : (npaths < 2 || npaths % 2 != 0);
+    if (usage_error) {
         fprintf(stderr,
-            "usage: %s [options] input.png output.png\n"
+            "usage: %s [options] input.png output.png [input2.png output2.png ...]\n"
+             "       %s [options] -m manifest\n"
+             "       %s [options] -u palette.pal [-H histogram] [input.png ...]\n"
              "options: \n"
              "\t -b bit_depth (logical, default: 8) \n \t -db output_bit_depth (default: =bit_depth) \n"
              "\t -n max_colors (default: 256) \n"
              "\t -s skip_slots; preceding slots filled with cyan (default: 0) \n"
              "\t -p preselect (slots purely selected by pixel frequency, default: 1)\n"
-             "\t -v verbose (print selected color and cost information)\n", argv[0]);
+             "\t -S strip_rows (stream the image in strips of this many rows, 0: load whole image, default: 0)\n"
+             "\t -m manifest (batch of 'input output' lines, processed in one run)\n"
+             "\t -P palette.pal (quantize_png: remap to this JASC palette at output_bit_depth instead of building one)\n"
+             "\t -u palette.pal (png_to_jasc: build one palette from all inputs)\n"
+             "\t -H histogram (with -u: merge the inputs into this saved histogram, creating it if missing)\n"
+             "\t -t tile_size (png_to_jasc: one sub-palette per tile, assignment written to output.tiles)\n"
+             "\t -z level (quantize_png: zlib compression level 0-9, default: 6)\n"
+             "\t -f filter (quantize_png: none, sub, up, avg, paeth or adaptive, default: none)\n"
+             "\t -d dither (quantize_png: none, fs (Floyd-Steinberg) or ordered (8x8 Bayer), default: none)\n"
+             "\t -sample fraction (build the histogram from about this fraction of the pixels, default: 1)\n"
+             "\t -sampling mode (stratified: random pixel per cell, fixed seed; strided: regular grid; default: stratified)\n"
+             "\t -k iterations (refine the palette with up to this many weighted k-means passes over the histogram, default: 0)\n"
+             "\t -kt threshold (stop refining once a pass lowers the mean error by less than this fraction, default: 0.001)\n"
+             "\t -raw format (quantize_png: write linear rows, planar or interleaved 8x8 bitplane tiles and output.pal.bin instead of a PNG)\n"
+             "\t -bpp bits (bits per pixel for -raw, default: fewest that index the palette)\n"
+             "\t -cache (quantize_png: keep strip hashes, histograms and indices in output.qcache; reruns redo only changed strips)\n"
+             "\t -stats file (append a JSON line with stage timings and counters, -: stderr)\n"
+             "\t -v verbose (print selected color and cost information)\n", argv[0], argv[0], argv[0]);
         exit(1);
     }
 
-    *in_path = argv[i];
-    *out_path = argv[i + 1];
-}
-
-static int cmp_color(const void *a, const void *b) {
-    return ((const Color*)b)->count - ((const Color*)a)->count;
+    if (config->shared_palette_path) jobs_from_inputs(jobs, &argv[i], npaths, config->shared_palette_path);
+    else if (manifest) jobs_from_manifest(jobs, manifest);
+    else jobs_from_args(jobs, &argv[i], npaths);
 }
 
-void die(const char *msg) {
-    perror(msg);
-    exit(1);
+static int parallel_level(void) {
+#ifdef _OPENMP
+    return omp_get_level();
+#else
+    return 0;
+#endif
 }
 
-static int color_dist(const Color *a, const Color *b) {
-    int dr = abs(a->r - b->r);
-    int dg = abs(a->g - b->g);
-    int db = abs(a->b - b->b);
-    return dr + dg + db
-         + abs(dr - dg)
-         + abs(dr - db)
-         + abs(dg - db);
-}
+// When the calling thread has installed a handler (library use), die() unwinds to it instead of exiting
+static __thread jmp_buf *die_target = NULL;
+static __thread int die_level = 0;
 
-static double min_dist(const Color *c, Color *sel, int n) {
-    double min = 1e30;
-    for (int i = 0; i < n; i++) {
-        double d = color_dist(c, &sel[i]);
-        if (d < min) min = d;
-    }
-    return min;
+void set_die_handler(jmp_buf *target) {
+    die_target = target;
+    die_level = parallel_level();
 }
 
-static int find_closest_color(int r, int g, int b, Color *palette, int pal_size) {
-    Color c = {r, g, b, 0};
-    int best_idx = 0;
-    int best_dist = color_dist(&c, &palette[0]);
-    
-    for (int i = 1; i < pal_size; i++) {
-        int dist = color_dist(&c, &palette[i]);
-        if (dist < best_dist) {
-            best_dist = dist;
-            best_idx = i;
-        }
-    }
-    return best_idx;
+// Jumping out of a parallel region is undefined, so a handler only catches failures at the level it was
+// installed at. Pipeline stages check their allocations outside their parallel regions; anything still
+// failing inside one exits.
+void die(const char *msg) {
+    if (die_target && parallel_level() == die_level) longjmp(*die_target, 1);
+    perror(msg);
+    exit(1);
 }
 
-Color* collect_colors(png_bytep *rows, int w, int h, int channels, int bit_depth, size_t *out_size, int verbose) {
+void collect_colors(png_bytep *rows, int w, int h, int channels, int bit_depth, ColorCounts *out, int verbose) {
 #ifdef _OPENMP
     int num_threads = omp_get_max_threads();
     if (verbose) fprintf(stderr, "using %d threads\n", num_threads);
 #else
     int num_threads = 1;
+    (void)verbose;
 #endif
 
-    size_t *local_ncolors, *local_countercapacities;
-    Color **local_colcounters = allocate_local_colcounters(num_threads, &local_ncolors, &local_countercapacities);
-
-#ifdef _OPENMP
-    #pragma omp parallel for schedule(dynamic, DYNAMIC_CHUNK_SIZE)
-#endif
-    for (int y = 0; y < h; y++) {
-#ifdef _OPENMP
-        int thread_id = omp_get_thread_num();
-#else
-        int thread_id = 0;
-#endif
-
-        Color *colcounter = local_colcounters[thread_id];
-        size_t *ncolors = &local_ncolors[thread_id];
-        size_t *capacity = &local_countercapacities[thread_id];
-
-        for (int x = 0; x < w; x++) {
-            png_bytep px = &rows[y][x * channels];
-            int r = px[0] >> (8 - bit_depth);
-            int g = px[1] >> (8 - bit_depth);
-            int b = px[2] >> (8 - bit_depth);
-
-            size_t j;
-            for (j = 0; j < *ncolors; j++) {
-                if (colcounter[j].r == r && colcounter[j].g == g && colcounter[j].b == b) {
-                    colcounter[j].count++;
-                    break;
-                }
-            }
-            
-            if (j == *ncolors) {
-                if (*ncolors == *capacity) {
-                    *capacity *= 2;
-                    colcounter = realloc(colcounter, *capacity * sizeof(Color));
-                    if (!colcounter) die("realloc thread colcounter");
-                    local_colcounters[thread_id] = colcounter;
-                }
-                colcounter[(*ncolors)++] = (Color){ r, g, b, 1 };
-            }
-        }
-    }
+    ColorHistogram hist;
+    histogram_init(&hist, bit_depth, num_threads);
+    histogram_add_rows(&hist, rows, w, h, channels);
+    histogram_colors(&hist, out);
+    histogram_free(&hist);
+    stats_count(&run_stats.unique_colors, out->size);
+}
 
-    Color *merged_colcounter = merge_local_colcounters(local_colcounters, local_ncolors, num_threads, out_size);
-    
-    free(local_colcounters);
-    free(local_ncolors);
-    free(local_countercapacities);
-    
-    return merged_colcounter;
+static inline Color key_color(uint32_t key) {
+    return (Color){ (int)(key >> 16), (int)((key >> 8) & 0xFF), (int)(key & 0xFF) };
 }
 
-Color* build_palette(Color *all_colors, size_t num_colors, const PaletteConfig *config, int *out_pal_size) {
-    qsort(all_colors, num_colors, sizeof(Color), cmp_color);
+// Sorts `colors` in place, most frequent first
+Color* build_palette(ColorCounts *colors, const PaletteConfig *config, int *out_pal_size) {
+    sort_color_counts(colors);
+    size_t num_colors = colors->size;
 
     int full_pal_len = config->max_colors > 0 ? config->max_colors : (int)num_colors + config->skip;
     int constructed_pal_len = config->max_colors > 0 ? config->max_colors - config->skip : (int)num_colors;
@@ -192,8 +282,30 @@ Color* build_palette(Color *all_colors, size_t num_colors, const PaletteConfig *
     if (preselect < 1) preselect = 1;
     if (preselect > constructed_pal_len) preselect = constructed_pal_len;
 
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+#endif
+    // Distance from each candidate to its closest selected color; only the newest entry can lower it
+    PaletteSoA candidates;
+    palette_soa_init_keys(&candidates, colors->keys, num_colors);
     Color *selected = malloc(full_pal_len * sizeof(Color));
-    Color cyan = {0, 255 >> (8 - config->bit_depth), 255 >> (8 - config->bit_depth), 0};
+    char *used = calloc(num_colors, 1);
+    int16_t *best_dist = malloc(num_colors * sizeof(int16_t));
+    uint64_t *thread_cost = malloc(max_threads * sizeof(uint64_t));
+    int *thread_idx = malloc(max_threads * sizeof(int));
+    if (!selected || !used || !best_dist || !thread_cost || !thread_idx) {
+        free(selected);
+        free(used);
+        free(best_dist);
+        free(thread_cost);
+        free(thread_idx);
+        palette_soa_free(&candidates);
+        die("malloc palette selection state");
+    }
+    stats_count(&run_stats.bytes_allocated, full_pal_len * sizeof(Color) + num_colors * (1 + sizeof(int16_t)));
+    Color cyan = {0, 255 >> (8 - config->bit_depth), 255 >> (8 - config->bit_depth)};
     int selected_count = 0;
 
     int i;
@@ -203,106 +315,583 @@ Color* build_palette(Color *all_colors, size_t num_colors, const PaletteConfig *
             fprintf(stderr, " %3d: #%d,%d,%d\n", selected_count, cyan.r, cyan.g, cyan.b);
     }
     for (i = 0; i < preselect; i++) {
-        selected[selected_count++] = all_colors[i];
+        selected[selected_count++] = key_color(colors->keys[i]);
         if (config->verbose)
-            fprintf(stderr, " %3d: #%d,%d,%d (count: %d)\n",
-            selected_count, all_colors[i].r, all_colors[i].g, all_colors[i].b, all_colors[i].count);
+            fprintf(stderr, " %3d: #%d,%d,%d (count: %llu)\n", selected_count, selected[selected_count - 1].r,
+                    selected[selected_count - 1].g, selected[selected_count - 1].b,
+                    (unsigned long long)colors->counts[i]);
     }
 
-    char *used = calloc(num_colors, 1);
     for (int i = 0; i < preselect; i++)
         used[i] = 1;
+    for (size_t i = 0; i < num_colors; i++)
+        best_dist[i] = INT16_MAX;
+
+    int done = 0;
+    int initial_count = selected_count;
+
+#ifdef _OPENMP
+    #pragma omp parallel if (num_colors >= PARALLEL_SCAN_MIN_COLORS)
+#endif
+    {
+#ifdef _OPENMP
+        int thread_id = omp_get_thread_num();
+        int team = omp_get_num_threads();
+#else
+        int thread_id = 0;
+        int team = 1;
+#endif
+        size_t lo = num_colors * thread_id / team;
+        size_t hi = num_colors * (thread_id + 1) / team;
+
+        for (int k = 0; k < selected_count; k++)
+            candidates.kernels->update_min(&candidates, lo, hi, selected[k].r, selected[k].g, selected[k].b, best_dist);
 
-    while (selected_count < constructed_pal_len + config->skip) {
-        int highest_cost = -1;
-        int best_candidate_idx = -1;
+        while (!done && selected_count < constructed_pal_len + config->skip) {
+            uint64_t local_cost = 0;
+            int local_idx = -1;
+            const Color *newest = &selected[selected_count - 1];
 
-        for (int i = 0; i < (int)num_colors; i++) {
-            if (used[i]) continue;
+            candidates.kernels->update_min(&candidates, lo, hi, newest->r, newest->g, newest->b, best_dist);
+            for (size_t i = lo; i < hi; i++) {
+                if (used[i]) continue;
 
-            int md = min_dist(&all_colors[i], selected, selected_count);
-            int cost = md * all_colors[i].count;
+                uint64_t cost = (uint64_t)best_dist[i] * colors->counts[i];
 
-            if (cost > highest_cost) {
-                highest_cost = cost;
-                best_candidate_idx = i;
+                if (local_idx < 0 || cost > local_cost) {
+                    local_cost = cost;
+                    local_idx = (int)i;
+                }
             }
-        }
+            thread_cost[thread_id] = local_cost;
+            thread_idx[thread_id] = local_idx;
+
+#ifdef _OPENMP
+            #pragma omp barrier
+            #pragma omp single
+#endif
+            {
+                // Equal costs resolve to the lowest index, matching a serial scan for any team size
+                uint64_t highest_cost = 0;
+                int best_candidate_idx = -1;
+                for (int t = 0; t < team; t++) {
+                    if (thread_idx[t] < 0) continue;
+                    if (best_candidate_idx < 0 || thread_cost[t] > highest_cost ||
+                        (thread_cost[t] == highest_cost && thread_idx[t] < best_candidate_idx)) {
+                        highest_cost = thread_cost[t];
+                        best_candidate_idx = thread_idx[t];
+                    }
+                }
+
+                if (best_candidate_idx < 0) {
+                    done = 1;
+                } else {
+                    used[best_candidate_idx] = 1;
+                    selected[selected_count++] = key_color(colors->keys[best_candidate_idx]);
 
-        if (best_candidate_idx < 0) break;
-
-        used[best_candidate_idx] = 1;
-        selected[selected_count++] = all_colors[best_candidate_idx];
-        
-        if (config->verbose) {
-            fprintf(stderr, " %3d: #%d,%d,%d (count: %d, cost: %d)\n",
-                    selected_count,
-                    selected[selected_count - 1].r,
-                    selected[selected_count - 1].g,
-                    selected[selected_count - 1].b,
-                    selected[selected_count - 1].count, highest_cost);
-            fflush(stderr);
+                    if (config->verbose) {
+                        fprintf(stderr, " %3d: #%d,%d,%d (count: %llu, cost: %llu)\n",
+                                selected_count,
+                                selected[selected_count - 1].r,
+                                selected[selected_count - 1].g,
+                                selected[selected_count - 1].b,
+                                (unsigned long long)colors->counts[best_candidate_idx],
+                                (unsigned long long)highest_cost);
+                        fflush(stderr);
+                    }
+                }
+            }
         }
     }
 
+    if (config->kmeans_iterations > 0) refine_palette(selected, selected_count, colors, config);
+
+    // Every round, plus the initial pass per preselected color, evaluates each candidate once
+    stats_count(&run_stats.greedy_iterations, selected_count - initial_count);
+    stats_count(&run_stats.distance_evals, (uint64_t)selected_count * num_colors);
+
+    free(thread_cost);
+    free(thread_idx);
     free(used);
+    free(best_dist);
+    palette_soa_free(&candidates);
     *out_pal_size = selected_count;
     return selected;
 }
 
-static Color** allocate_local_colcounters(int num_threads, size_t **local_ncolors, size_t **local_capacities) {
-    Color **tables = malloc(num_threads * sizeof(Color*));
-    *local_ncolors = calloc(num_threads, sizeof(size_t));
-    *local_capacities = malloc(num_threads * sizeof(size_t));
-    
-    for (int t = 0; t < num_threads; t++) {
-        (*local_capacities)[t] = INITIAL_N_COLORS;
-        tables[t] = malloc((*local_capacities)[t] * sizeof(Color));
-        if (!tables[t]) die("malloc local colcounter");
-    }
-    return tables;
-}
-
-static Color* merge_local_colcounters(Color **local_colcounters, size_t *local_ncolors, int num_threads, size_t *out_size) {
-    size_t capacity = INITIAL_N_COLORS;
-    size_t ncolors = 0;
-    Color *colcounter = malloc(capacity * sizeof(Color));
-    if (!colcounter) die("malloc final colcounter");
-
-    for (int t = 0; t < num_threads; t++) {
-        for (size_t i = 0; i < local_ncolors[t]; i++) {
-            Color *c = &local_colcounters[t][i];
-            
-            size_t j;
-            for (j = 0; j < ncolors; j++) {
-                if (colcounter[j].r == c->r && colcounter[j].g == c->g && colcounter[j].b == c->b) {
-                    colcounter[j].count += c->count;
-                    break;
-                }
+uint32_t hash_key(uint32_t key) {
+    key ^= key >> 16;
+    key *= 0x7feb352dU;
+    key ^= key >> 15;
+    key *= 0x846ca68bU;
+    key ^= key >> 16;
+    return key;
+}
+
+// Keys are at most 24 bits wide, so an all-ones key marks an empty bucket
+#define EMPTY_KEY 0xFFFFFFFFU
+
+// Returns -1, leaving an empty table that table_free accepts, when allocation fails
+static int table_alloc(ColorTable *t, size_t capacity) {
+    t->capacity = capacity;
+    t->size = 0;
+    t->probes = 0;
+    t->failed = 0;
+    t->keys = malloc(capacity * sizeof(uint32_t));
+    t->counts = malloc(capacity * sizeof(uint64_t));
+    if (!t->keys || !t->counts) {
+        table_free(t);
+        return -1;
+    }
+    stats_count(&run_stats.bytes_allocated, capacity * (sizeof(uint32_t) + sizeof(uint64_t)));
+    memset(t->keys, 0xFF, capacity * sizeof(uint32_t));
+    return 0;
+}
+
+static void table_free(ColorTable *t) {
+    free(t->keys);
+    free(t->counts);
+    t->keys = NULL;
+    t->counts = NULL;
+}
+
+// Tables grow inside parallel regions, so a failure only sets `failed`; the table keeps its old contents
+static void table_grow(ColorTable *t) {
+    ColorTable old = *t;
+
+    if (table_alloc(t, old.capacity * 2)) {
+        *t = old;
+        t->failed = 1;
+        return;
+    }
+    t->probes = old.probes;
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.keys[i] != EMPTY_KEY)
+            table_add(t, old.keys[i], old.counts[i]);
+    }
+    table_free(&old);
+}
+
+static void table_add(ColorTable *t, uint32_t key, uint64_t n) {
+    size_t mask = t->capacity - 1;
+    size_t i = hash_key(key) & mask;
+    t->probes++;
+    while (t->keys[i] != EMPTY_KEY) {
+        if (t->keys[i] == key) {
+            t->counts[i] += n;
+            return;
+        }
+        i = (i + 1) & mask;
+        t->probes++;
+    }
+
+    // Keep the load factor at or below 1/2 so probe sequences stay short
+    if ((t->size + 1) * 2 > t->capacity) {
+        table_grow(t);
+        // The count is dropped; the owner of the table reports the failure
+        if (t->failed) return;
+        table_add(t, key, n);
+        return;
+    }
+    t->keys[i] = key;
+    t->counts[i] = n;
+    t->size++;
+}
+
+void histogram_init(ColorHistogram *hist, int bit_depth, int num_threads) {
+    hist->bit_depth = bit_depth;
+    hist->num_threads = num_threads;
+    hist->dense = NULL;
+    hist->wide = NULL;
+    hist->pending = NULL;
+    hist->tables = NULL;
+
+    if (bit_depth <= DENSE_HISTOGRAM_MAX_DEPTH) {
+        size_t nbins = (size_t)1 << (3 * bit_depth);
+        hist->dense = calloc(num_threads, sizeof(uint32_t*));
+        hist->wide = calloc(nbins, sizeof(uint64_t));
+        hist->pending = calloc(num_threads, sizeof(uint64_t));
+        int failed = !hist->dense || !hist->wide || !hist->pending;
+        for (int t = 0; !failed && t < num_threads; t++)
+            failed = !(hist->dense[t] = calloc(nbins, sizeof(uint32_t)));
+        if (failed) {
+            histogram_free(hist);
+            die("malloc dense histogram");
+        }
+        stats_count(&run_stats.bytes_allocated, num_threads * nbins * sizeof(uint32_t) + nbins * sizeof(uint64_t));
+    } else {
+        hist->tables = calloc(num_threads, sizeof(ColorTable));
+        int failed = !hist->tables;
+        for (int t = 0; !failed && t < num_threads; t++)
+            failed = table_alloc(&hist->tables[t], INITIAL_N_COLORS);
+        if (failed) {
+            histogram_free(hist);
+            die("malloc color tables");
+        }
+    }
+}
+
+// Tables that failed to grow dropped counts; reported here, once the parallel region has ended
+static void histogram_check_tables(const ColorHistogram *hist) {
+    for (int t = 0; hist->tables && t < hist->num_threads; t++) {
+        if (hist->tables[t].failed) die("grow color table");
+    }
+}
+
+void histogram_reset(ColorHistogram *hist) {
+    size_t nbins = (size_t)1 << (3 * hist->bit_depth);
+    if (hist->dense) memset(hist->wide, 0, nbins * sizeof(uint64_t));
+    for (int t = 0; t < hist->num_threads; t++) {
+        if (hist->dense) {
+            memset(hist->dense[t], 0, nbins * sizeof(uint32_t));
+            hist->pending[t] = 0;
+        } else {
+            memset(hist->tables[t].keys, 0xFF, hist->tables[t].capacity * sizeof(uint32_t));
+            hist->tables[t].size = 0;
+            hist->tables[t].probes = 0;
+            hist->tables[t].failed = 0;
+        }
+    }
+}
+
+// Also releases a partly initialized histogram
+void histogram_free(ColorHistogram *hist) {
+    for (int t = 0; t < hist->num_threads; t++) {
+        if (hist->dense) free(hist->dense[t]);
+        if (hist->tables) table_free(&hist->tables[t]);
+    }
+    free(hist->dense);
+    free(hist->wide);
+    free(hist->pending);
+    free(hist->tables);
+    hist->dense = NULL;
+    hist->wide = NULL;
+    hist->pending = NULL;
+    hist->tables = NULL;
+}
+
+int pixel_format_index(int bit_depth, int channels) {
+    if (bit_depth < 1 || bit_depth > 8 || (channels != 3 && channels != 4)) {
+        fprintf(stderr, "unsupported pixel format: bit depth %d, %d channels\n", bit_depth, channels);
+        die("pixel format");
+    }
+    return PIXEL_FORMAT_INDEX(bit_depth, channels);
+}
+
+KERNEL_INLINE void dense_row(uint32_t *counts, png_const_bytep row, int w, int bit_depth, int channels) {
+    int shift = 8 - bit_depth;
+    for (int x = 0; x < w; x++) {
+        png_const_bytep px = &row[x * channels];
+        uint32_t idx = ((uint32_t)(px[0] >> shift) << (2 * bit_depth))
+                     | ((uint32_t)(px[1] >> shift) << bit_depth)
+                     | (uint32_t)(px[2] >> shift);
+        counts[idx]++;
+    }
+}
+
+// Runs of identical pixels are common, so count a run before touching the table
+KERNEL_INLINE void table_row(ColorTable *table, png_const_bytep row, int w, int bit_depth, int channels) {
+    int shift = 8 - bit_depth;
+    uint32_t run_key = EMPTY_KEY;
+    uint32_t run_len = 0;
+    for (int x = 0; x < w; x++) {
+        png_const_bytep px = &row[x * channels];
+        uint32_t key = ((uint32_t)(px[0] >> shift) << 16)
+                     | ((uint32_t)(px[1] >> shift) << 8)
+                     | (uint32_t)(px[2] >> shift);
+        if (key == run_key) {
+            run_len++;
+            continue;
+        }
+        if (run_len) table_add(table, run_key, run_len);
+        run_key = key;
+        run_len = 1;
+    }
+    if (run_len) table_add(table, run_key, run_len);
+}
+
+typedef void (*DenseRowFn)(uint32_t *counts, png_const_bytep row, int w);
+typedef void (*TableRowFn)(ColorTable *table, png_const_bytep row, int w);
+
+#define HISTOGRAM_ROW_KERNELS(D, C) \
+    static void dense_row_##D##_##C(uint32_t *counts, png_const_bytep row, int w) { dense_row(counts, row, w, D, C); } \
+    static void table_row_##D##_##C(ColorTable *table, png_const_bytep row, int w) { table_row(table, row, w, D, C); }
+FOR_EACH_PIXEL_FORMAT(HISTOGRAM_ROW_KERNELS)
+
+#define DENSE_ROW_ENTRY(D, C) [PIXEL_FORMAT_INDEX(D, C)] = dense_row_##D##_##C,
+#define TABLE_ROW_ENTRY(D, C) [PIXEL_FORMAT_INDEX(D, C)] = table_row_##D##_##C,
+static const DenseRowFn dense_row_kernels[NUM_PIXEL_FORMATS] = { FOR_EACH_PIXEL_FORMAT(DENSE_ROW_ENTRY) };
+static const TableRowFn table_row_kernels[NUM_PIXEL_FORMATS] = { FOR_EACH_PIXEL_FORMAT(TABLE_ROW_ENTRY) };
+
+// Moves slot t's 32-bit counts into the shared 64-bit ones once `n` more pixels could overflow them;
+// slots of one histogram can be counted from an outer parallel loop, hence the critical section
+static void dense_reserve(ColorHistogram *hist, int t, int n) {
+    if (hist->pending[t] + n <= UINT32_MAX) {
+        hist->pending[t] += n;
+        return;
+    }
+    size_t nbins = (size_t)1 << (3 * hist->bit_depth);
+#ifdef _OPENMP
+    #pragma omp critical(histogram_fold)
+#endif
+    for (size_t i = 0; i < nbins; i++)
+        hist->wide[i] += hist->dense[t][i];
+    memset(hist->dense[t], 0, nbins * sizeof(uint32_t));
+    hist->pending[t] = n;
+}
+
+void histogram_add_rows(ColorHistogram *hist, png_bytep *rows, int w, int h, int channels) {
+    int format = pixel_format_index(hist->bit_depth, channels);
+    DenseRowFn dense_kernel = dense_row_kernels[format];
+    TableRowFn table_kernel = table_row_kernels[format];
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, DYNAMIC_CHUNK_SIZE) num_threads(hist->num_threads)
+#endif
+    for (int y = 0; y < h; y++) {
+#ifdef _OPENMP
+        int thread_id = omp_get_thread_num();
+#else
+        int thread_id = 0;
+#endif
+        if (hist->dense) {
+            dense_reserve(hist, thread_id, w);
+            dense_kernel(hist->dense[thread_id], rows[y], w);
+        } else
+            table_kernel(&hist->tables[thread_id], rows[y], w);
+    }
+    histogram_check_tables(hist);
+}
+
+// Counts the pixels `sampler` picks from rows y0 .. y0 + n - 1 of an h-row image; rows it skips may be NULL
+void histogram_add_sampled_rows(ColorHistogram *hist, png_bytep *rows, int w, int n, int channels,
+                                int y0, int h, const Sampler *sampler) {
+    DenseRowFn dense_kernel = dense_row_kernels[pixel_format_index(hist->bit_depth, channels)];
+    TableRowFn table_kernel = table_row_kernels[pixel_format_index(hist->bit_depth, channels)];
+    uint64_t sampled = 0;
+    // The picked pixels of a row are packed into a short row per thread, so the specialized kernels apply unchanged
+    size_t picked_bytes = (size_t)sampler_columns(sampler, w) * channels;
+    png_bytep picked_rows = malloc(hist->num_threads * picked_bytes);
+    if (!picked_rows) die("malloc sample rows");
+
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(hist->num_threads) reduction(+:sampled)
+#endif
+    {
+#ifdef _OPENMP
+        int thread_id = omp_get_thread_num();
+#else
+        int thread_id = 0;
+#endif
+        png_bytep picked = picked_rows + thread_id * picked_bytes;
+
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic, DYNAMIC_CHUNK_SIZE)
+#endif
+        for (int y = 0; y < n; y++) {
+            if (!sampler_takes_row(sampler, y0 + y, h)) continue;
+            int count = sampler_gather(sampler, rows[y], y0 + y, w, channels, picked);
+            if (hist->dense) {
+                dense_reserve(hist, thread_id, count);
+                dense_kernel(hist->dense[thread_id], picked, count);
+            } else
+                table_kernel(&hist->tables[thread_id], picked, count);
+            sampled += count;
+        }
+    }
+    free(picked_rows);
+    histogram_check_tables(hist);
+    stats_count(&run_stats.sampled_pixels, sampled);
+}
+
+// Decodes `src` one strip at a time, so only strip_rows rows are held regardless of the image size.
+// Rows the sampler skips are still inflated, since PNG rows depend on the ones above, but not stored.
+void histogram_add_source(ColorHistogram *hist, const PngSource *src, int strip_rows, const Sampler *sampler) {
+    PngReader reader;
+    png_reader_open_source(&reader, src);
+    png_bytep *rows = alloc_rows(strip_rows, reader.row_bytes);
+    png_bytep *targets = malloc(strip_rows * sizeof(png_bytep));
+    if (!targets) die("malloc strip targets");
+    int sampled = sampler && sampler->active;
+    for (int y = 0; y < reader.h; y += strip_rows) {
+        int n = reader.h - y < strip_rows ? reader.h - y : strip_rows;
+        for (int k = 0; k < n; k++)
+            targets[k] = !sampled || sampler_takes_row(sampler, y + k, reader.h) ? rows[k] : NULL;
+        png_reader_read_rows(&reader, targets, n);
+        if (sampled)
+            histogram_add_sampled_rows(hist, targets, reader.w, n, reader.channels, y, reader.h, sampler);
+        else
+            histogram_add_rows(hist, rows, reader.w, n, reader.channels);
+    }
+    free(targets);
+    free_rows(rows);
+    png_reader_close(&reader);
+}
+
+// Adds already-counted colors (e.g. a loaded histogram) to the 64-bit counts or the first thread's table
+void histogram_add_colors(ColorHistogram *hist, const ColorCounts *colors) {
+    int bit_depth = hist->bit_depth;
+    for (size_t i = 0; i < colors->size; i++) {
+        uint32_t key = colors->keys[i];
+        if (hist->dense) {
+            uint32_t idx = ((key >> 16) << (2 * bit_depth)) | (((key >> 8) & 0xFF) << bit_depth) | (key & 0xFF);
+            hist->wide[idx] += colors->counts[i];
+        } else {
+            table_add(&hist->tables[0], key, colors->counts[i]);
+        }
+    }
+    histogram_check_tables(hist);
+}
+
+// A single-threaded view of slot `t`, so workers of an outer parallel loop can count into one histogram
+ColorHistogram histogram_slot(const ColorHistogram *hist, int t) {
+    ColorHistogram slot = *hist;
+    slot.num_threads = 1;
+    slot.dense = hist->dense ? &hist->dense[t] : NULL;
+    slot.pending = hist->pending ? &hist->pending[t] : NULL;
+    slot.tables = hist->tables ? &hist->tables[t] : NULL;
+    return slot;
+}
+
+void histogram_colors(const ColorHistogram *hist, ColorCounts *out) {
+    if (hist->dense) {
+        merge_dense_counts(hist, out);
+    } else {
+        for (int t = 0; t < hist->num_threads; t++)
+            stats_count(&run_stats.hash_probes, hist->tables[t].probes);
+        merge_color_tables(hist, out);
+    }
+}
+
+// Output is in key order, since bin order is r, g, b major to minor like the key
+static void merge_dense_counts(const ColorHistogram *hist, ColorCounts *out) {
+    int bit_depth = hist->bit_depth;
+    int nt = hist->num_threads;
+    size_t nbins = (size_t)1 << (3 * bit_depth);
+    uint32_t mask = ((uint32_t)1 << bit_depth) - 1;
+
+    size_t *offsets = calloc(nt + 1, sizeof(size_t));
+    if (!offsets) die("calloc merge offsets");
+    int failed = 0;
+
+    // Each thread sums one contiguous slice of bins, then writes it out at its prefix offset
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(nt)
+#endif
+    {
+#ifdef _OPENMP
+        int t = omp_get_thread_num();
+        int team = omp_get_num_threads();
+#else
+        int t = 0;
+        int team = 1;
+#endif
+        size_t lo = nbins * t / team;
+        size_t hi = nbins * (t + 1) / team;
+
+        size_t nonzero = 0;
+        for (size_t i = lo; i < hi; i++) {
+            uint64_t sum = hist->wide[i];
+            for (int k = 0; k < nt; k++) sum += hist->dense[k][i];
+            if (sum) nonzero++;
+        }
+        offsets[t + 1] = nonzero;
+
+#ifdef _OPENMP
+        #pragma omp barrier
+        #pragma omp single
+#endif
+        {
+            for (int k = 0; k < team; k++) offsets[k + 1] += offsets[k];
+            failed = color_counts_try_alloc(out, offsets[team]);
+        }
+
+        size_t j = offsets[t];
+        for (size_t i = lo; i < hi && !failed; i++) {
+            uint64_t sum = hist->wide[i];
+            for (int k = 0; k < nt; k++) sum += hist->dense[k][i];
+            if (!sum) continue;
+            out->keys[j] = ((uint32_t)(i >> (2 * bit_depth)) << 16) | (((uint32_t)(i >> bit_depth) & mask) << 8)
+                         | ((uint32_t)i & mask);
+            out->counts[j++] = sum;
+        }
+    }
+
+    free(offsets);
+    if (failed) die("malloc color counts");
+}
+
+static void merge_color_tables(const ColorHistogram *hist, ColorCounts *out) {
+    int nt = hist->num_threads;
+    ColorTable *shards = malloc(nt * sizeof(ColorTable));
+    size_t *offsets = calloc(nt + 1, sizeof(size_t));
+    int failed = !shards || !offsets;
+    int ready = 0;
+    for (; !failed && ready < nt; ready++)
+        failed = table_alloc(&shards[ready], INITIAL_N_COLORS);
+    if (failed) {
+        for (int s = 0; s < ready; s++)
+            table_free(&shards[s]);
+        free(shards);
+        free(offsets);
+        die("malloc merge shards");
+    }
+
+    // Partition the key space into one shard per thread; each thread merges its shard from every table
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(nt)
+#endif
+    {
+#ifdef _OPENMP
+        int s = omp_get_thread_num();
+        int team = omp_get_num_threads();
+#else
+        int s = 0;
+        int team = 1;
+#endif
+        ColorTable *shard = &shards[s];
+
+        for (int t = 0; t < nt; t++) {
+            const ColorTable *local = &hist->tables[t];
+            for (size_t i = 0; i < local->capacity; i++) {
+                uint32_t key = local->keys[i];
+                if (key == EMPTY_KEY || (int)((hash_key(key) >> 16) % team) != s) continue;
+                table_add(shard, key, local->counts[i]);
             }
-            
-            if (j == ncolors) {
-                if (ncolors == capacity) {
-                    capacity *= 2;
-                    colcounter = realloc(colcounter, capacity * sizeof(Color));
-                    if (!colcounter) die("realloc final colcounter");
-                }
-                colcounter[ncolors++] = *c;
+        }
+        offsets[s + 1] = shard->size;
+
+#ifdef _OPENMP
+        #pragma omp barrier
+        #pragma omp single
+#endif
+        {
+            for (int k = 0; k < team; k++) {
+                offsets[k + 1] += offsets[k];
+                failed |= shards[k].failed;
             }
+            if (!failed) failed = color_counts_try_alloc(out, offsets[team]);
         }
-        free(local_colcounters[t]);
+
+        size_t j = offsets[s];
+        for (size_t i = 0; i < shard->capacity && !failed; i++) {
+            if (shard->keys[i] == EMPTY_KEY) continue;
+            out->keys[j] = shard->keys[i];
+            out->counts[j++] = shard->counts[i];
+        }
+        stats_count(&run_stats.hash_probes, shard->probes);
     }
-    
-    *out_size = ncolors;
-    return colcounter;
+
+    for (int s = 0; s < nt; s++)
+        table_free(&shards[s]);
+    free(shards);
+    free(offsets);
+    if (failed) die("merge color tables");
 }
 
-static png_bytep pack_row(png_bytep unpacked, int width, int bit_depth) {
+void pack_row(png_bytep unpacked, png_bytep packed, int width, int bit_depth) {
     int pixels_per_byte = 8 / bit_depth;
     int packed_width = (width + pixels_per_byte - 1) / pixels_per_byte;
-    
-    png_bytep packed = malloc(packed_width);
-    if (!packed) die("malloc packed_row");
     memset(packed, 0, packed_width);
     
     for (int x = 0; x < width; x++) {
@@ -310,8 +899,6 @@ static png_bytep pack_row(png_bytep unpacked, int width, int bit_depth) {
         int bit_offset = (pixels_per_byte - 1 - (x % pixels_per_byte)) * bit_depth;
         packed[byte_idx] |= (unpacked[x] << bit_offset);
     }
-    
-    return packed;
 }
 
 void convert_palette_depth(Color *palette, int pal_size, int bit_depth, int output_bit_depth) {
@@ -328,27 +915,44 @@ void convert_palette_depth(Color *palette, int pal_size, int bit_depth, int outp
     }
 }
 
-void write_palette_png(const char *path, int w, int h, Color *palette, int pal_size, 
-                               png_bytep *index_rows) {
-    FILE *out_fp = fopen(path, "wb");
-    if (!out_fp) {
-        fprintf(stderr, "Failed to open output file: %s\n", path);
-        die("open output");
+// Inverse of convert_palette_depth: replication keeps the logical value in the top bits
+void reduce_palette_depth(Color *palette, int pal_size, int bit_depth, int output_bit_depth) {
+    if (bit_depth == output_bit_depth) return;
+
+    for (int i = 0; i < pal_size; i++) {
+        palette[i].r >>= output_bit_depth - bit_depth;
+        palette[i].g >>= output_bit_depth - bit_depth;
+        palette[i].b >>= output_bit_depth - bit_depth;
     }
+}
 
-    png_structp out_png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-                                                   NULL, png_error_fn, png_warning_fn);
-    png_infop out_info = png_create_info_struct(out_png);
-    if (!out_png || !out_info) die("png write init");
+// The streaming encoder (-S) goes through libpng; whole images use the parallel write_palette_png
+void png_writer_open(PngWriter *wr, const char *path, int w, int h, Color *palette, int pal_size,
+                     const PaletteConfig *config) {
+    png_sink_open(&wr->sink, path);
 
-    png_init_io(out_png, out_fp);
+    wr->png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                      NULL, png_error_fn, png_warning_fn);
+    wr->info = png_create_info_struct(wr->png);
+    if (!wr->png || !wr->info) die("png write init");
+
+    png_set_write_fn(wr->png, &wr->sink, png_sink_write_fn, png_sink_flush_fn);
     
-    int png_bit_depth = 8;
-    if (pal_size <= 2) png_bit_depth = 1;
-    else if (pal_size <= 4) png_bit_depth = 2;
-    else if (pal_size <= 16) png_bit_depth = 4;
+    wr->w = w;
+    wr->bit_depth = png_index_bit_depth(pal_size);
+    png_set_compression_level(wr->png, config->compression_level);
+    static const int filter_masks[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG,
+                                        PNG_FILTER_PAETH, PNG_ALL_FILTERS };
+    png_set_filter(wr->png, PNG_FILTER_TYPE_BASE, filter_masks[config->png_filter]);
+
+    // Sub-byte rows are packed into this one scratch row before each png_write_row
+    wr->packed = NULL;
+    if (wr->bit_depth < 8) {
+        wr->packed = malloc((size_t)w * wr->bit_depth / 8 + 1);
+        if (!wr->packed) die("malloc packed row");
+    }
     
-    png_set_IHDR(out_png, out_info, w, h, png_bit_depth, PNG_COLOR_TYPE_PALETTE,
+    png_set_IHDR(wr->png, wr->info, w, h, wr->bit_depth, PNG_COLOR_TYPE_PALETTE,
                  PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
                  PNG_FILTER_TYPE_DEFAULT);
 
@@ -361,128 +965,249 @@ void write_palette_png(const char *path, int w, int h, Color *palette, int pal_s
         png_palette[i].blue = palette[i].b;
     }
     
-    png_set_PLTE(out_png, out_info, png_palette, pal_size);
-    png_write_info(out_png, out_info);
+    png_set_PLTE(wr->png, wr->info, png_palette, pal_size);
+    png_write_info(wr->png, wr->info);
     free(png_palette);
+}
 
-    if (png_bit_depth < 8) {
-        for (int y = 0; y < h; y++) {
-            png_bytep packed = pack_row(index_rows[y], w, png_bit_depth);
-            png_write_row(out_png, packed);
-            free(packed);
+void png_writer_write_rows(PngWriter *wr, png_bytep *index_rows, int n) {
+    if (wr->bit_depth < 8) {
+        for (int y = 0; y < n; y++) {
+            pack_row(index_rows[y], wr->packed, wr->w, wr->bit_depth);
+            png_write_row(wr->png, wr->packed);
         }
     } else {
-        for (int y = 0; y < h; y++) {
-            png_write_row(out_png, index_rows[y]);
+        for (int y = 0; y < n; y++) {
+            png_write_row(wr->png, index_rows[y]);
         }
     }
+}
 
-    png_write_end(out_png, NULL);
-    png_destroy_write_struct(&out_png, &out_info);
-    fclose(out_fp);
+void png_writer_close(PngWriter *wr) {
+    png_write_end(wr->png, NULL);
+    png_destroy_write_struct(&wr->png, &wr->info);
+    png_sink_close(&wr->sink);
+    free(wr->packed);
 }
 
-png_bytep* quantize_image(png_bytep *rows, int w, int h, int channels, int bit_depth, Color *palette, int pal_size) {
-    png_bytep *out_rows = malloc(h * sizeof(png_bytep));
-    if (!out_rows) die("malloc out_rows");
-    
-    for (int y = 0; y < h; y++) {
-        out_rows[y] = malloc(w);
-        if (!out_rows[y]) die("malloc out_row");
-    }
+static void write_jasc_entries(FILE *out, Color *palette, int pal_size, const PaletteConfig *config) {
+    int full_pal_len = config->max_colors > 0 ? config->max_colors : pal_size + config->skip;
+    int max_value = (1 << config->output_bit_depth) - 1;
 
-#ifdef _OPENMP
-    #pragma omp parallel for schedule(dynamic, DYNAMIC_CHUNK_SIZE)
-#endif
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            png_bytep px = &rows[y][x * channels];
-            int r = px[0] >> (8 - bit_depth);
-            int g = px[1] >> (8 - bit_depth);
-            int b = px[2] >> (8 - bit_depth);
-
-            int idx = find_closest_color(r, g, b, palette, pal_size);
-            out_rows[y][x] = idx;
-        }
-    }
+    for (int k = 0; k < pal_size; k++)
+        fprintf(out, "%d %d %d\n",
+                palette[k].r, palette[k].g, palette[k].b);
 
-    return out_rows;
+    // pal_size already counts the -s slots, so a short palette is padded with cyan up to the full length
+    for (int k = pal_size; k < full_pal_len; k++)
+        fprintf(out, "0 %d %d\n", max_value, max_value);
 }
 
 void write_jasc_palette(const char *path, Color *palette, int pal_size, const PaletteConfig *config) {
-    FILE *out = fopen(path, "w");
+    write_jasc_palette_set(path, &palette, &pal_size, 1, config);
+}
+
+// Sub-palettes back to back, each padded to max_colors, so palette k starts at entry k * max_colors
+void write_jasc_palette_set(const char *path, Color **palettes, const int *pal_sizes, int count, const PaletteConfig *config) {
+    FILE *out = strcmp(path, "-") ? fopen(path, "w") : stdout;
     if (!out) {
         fprintf(stderr, "Failed to write to file: %s\n", path);
         die("write results");
     }
 
-    int full_pal_len = config->max_colors > 0 ? config->max_colors : pal_size + config->skip;
-    int max_value = (1 << config->output_bit_depth) - 1;
-    
-    fprintf(out, "JASC-PAL\n0100\n%d\n", full_pal_len);
+    int total = 0;
+    for (int p = 0; p < count; p++)
+        total += config->max_colors > 0 ? config->max_colors : pal_sizes[p] + config->skip;
+    fprintf(out, "JASC-PAL\n0100\n%d\n", total);
 
-    int written = 0;
-    for (int k = 0; k < pal_size; k++, written++)
-        fprintf(out, "%d %d %d\n",
-                palette[k].r, palette[k].g, palette[k].b);
+    for (int p = 0; p < count; p++)
+        write_jasc_entries(out, palettes[p], pal_sizes[p], config);
 
-    for (int k = written + config->skip; k < full_pal_len; k++)
-        fprintf(out, "0 %d %d\n", max_value, max_value);
+    if (out == stdout ? fflush(out) : fclose(out)) die("write results");
+}
 
-    fclose(out);
+// The entries of the JASC palette as binary at output_bit_depth. Up to 5 bits per channel, each entry is a
+// little-endian 16-bit word with red in the low bits (BGR555 at -db 5); above that, bytes r, g, b.
+void write_raw_palette(const char *path, Color *palette, int pal_size, const PaletteConfig *config) {
+    int full_pal_len = config->max_colors > 0 ? config->max_colors : pal_size + config->skip;
+    // pal_size already counts the -s slots, so the file always holds full_pal_len entries, as the JASC palette does
+    int count = full_pal_len > pal_size ? full_pal_len : pal_size;
+    int depth = config->output_bit_depth;
+    int max_value = (1 << depth) - 1;
+    int entry_bytes = 3 * depth <= 16 ? 2 : 3;
+
+    unsigned char *data = malloc((size_t)count * entry_bytes);
+    if (!data) die("malloc raw palette");
+    unsigned char *p = data;
+    for (int k = 0; k < count; k++) {
+        Color c = k < pal_size ? palette[k] : (Color){ 0, max_value, max_value };
+        if (entry_bytes == 2) {
+            uint32_t word = c.r | c.g << depth | c.b << 2 * depth;
+            *p++ = word & 0xFF;
+            *p++ = word >> 8;
+        } else {
+            *p++ = c.r;
+            *p++ = c.g;
+            *p++ = c.b;
+        }
+    }
+
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        fprintf(stderr, "Failed to write to file: %s\n", path);
+        die("write results");
+    }
+    size_t put = fwrite(data, entry_bytes, count, out);
+    if (fclose(out) || put != (size_t)count) die("write results");
+    free(data);
 }
 
-png_bytep* read_png_image(const char *path, int *w, int *h, int *channels) {
-    FILE *fp = fopen(path, "rb");
-    if (!fp) {
-        fprintf(stderr, "Failed to open input file: %s\n", path);
-        die("open input");
+Color* read_jasc_palette(const char *path, int output_bit_depth, int *pal_size) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "Failed to open palette: %s\n", path);
+        die("open palette");
+    }
+
+    int count;
+    char magic[16], version[16];
+    if (fscanf(in, "%15s %15s %d", magic, version, &count) != 3 || strcmp(magic, "JASC-PAL")) {
+        fprintf(stderr, "%s: not a JASC-PAL file\n", path);
+        exit(1);
     }
+    if (count < 1 || count > 256) {
+        fprintf(stderr, "%s: expected 1 to 256 colors (got %d)\n", path, count);
+        exit(1);
+    }
+
+    Color *palette = malloc(count * sizeof(Color));
+    if (!palette) die("malloc palette");
+    int max_value = (1 << output_bit_depth) - 1;
+    for (int k = 0; k < count; k++) {
+        Color *c = &palette[k];
+        if (fscanf(in, "%d %d %d", &c->r, &c->g, &c->b) != 3) {
+            fprintf(stderr, "%s: expected %d colors, found %d\n", path, count, k);
+            exit(1);
+        }
+        if (c->r < 0 || c->g < 0 || c->b < 0 || c->r > max_value || c->g > max_value || c->b > max_value) {
+            fprintf(stderr, "%s: color %d (%d,%d,%d) exceeds output bit depth %d; pass the matching -db\n",
+                    path, k + 1, c->r, c->g, c->b, output_bit_depth);
+            exit(1);
+        }
+    }
+    fclose(in);
+
+    *pal_size = count;
+    return palette;
+}
 
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 
-                                             NULL, png_error_fn, png_warning_fn);
-    png_infop info = png_create_info_struct(png);
-    if (!png || !info) die("png init");
+static void png_reader_start(PngReader *rd) {
+    rd->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 
+                                     NULL, png_error_fn, png_warning_fn);
+    rd->info = png_create_info_struct(rd->png);
+    if (!rd->png || !rd->info) die("png init");
 
-    png_init_io(png, fp);
-    png_read_info(png, info);
+    png_set_read_fn(rd->png, &rd->source, png_source_read_fn);
+    png_read_info(rd->png, rd->info);
 
-    *w = png_get_image_width(png, info);
-    *h = png_get_image_height(png, info);
+    rd->w = png_get_image_width(rd->png, rd->info);
+    rd->h = png_get_image_height(rd->png, rd->info);
     
-    if (*w * *h > 10 * 1024 * 1024) {
-        fprintf(stderr, "provided image has %d pixels, this may take a while...\n", *w * *h);
+    if (rd->w * rd->h > 10 * 1024 * 1024) {
+        fprintf(stderr, "provided image has %d pixels, this may take a while...\n", rd->w * rd->h);
     }
     
-    int color = png_get_color_type(png, info);
-    int depth = png_get_bit_depth(png, info);
+    int color = png_get_color_type(rd->png, rd->info);
+    int depth = png_get_bit_depth(rd->png, rd->info);
 
-    if (depth == 16) png_set_strip_16(png);
-    if (color == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
+    if (depth == 16) png_set_strip_16(rd->png);
+    if (color == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(rd->png);
     if (color == PNG_COLOR_TYPE_GRAY || color == PNG_COLOR_TYPE_GRAY_ALPHA)
-        png_set_gray_to_rgb(png);
-    if (png_get_valid(png, info, PNG_INFO_tRNS))
-        png_set_tRNS_to_alpha(png);
+        png_set_gray_to_rgb(rd->png);
+    if (png_get_valid(rd->png, rd->info, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(rd->png);
 
-    png_read_update_info(png, info);
-    *channels = png_get_channels(png, info);
+    png_read_update_info(rd->png, rd->info);
+    rd->channels = png_get_channels(rd->png, rd->info);
+    rd->row_bytes = png_get_rowbytes(rd->png, rd->info);
+}
 
-    size_t row_bytes = png_get_rowbytes(png, info);
-    png_bytep *rows = malloc(*h * sizeof(png_bytep));
-    if (!rows) die("malloc rows");
-    
-    for (int y = 0; y < *h; y++) {
-        rows[y] = malloc(row_bytes);
-        if (!rows[y]) die("malloc row");
-        png_read_row(png, rows[y], NULL);
-    }
+void png_reader_open(PngReader *rd, const char *path) {
+    png_source_open(&rd->source, path);
+    rd->owns_source = 1;
+    png_reader_start(rd);
+}
 
-    png_destroy_read_struct(&png, &info, NULL);
-    fclose(fp);
-    
+// Decodes from the start of an already opened source, e.g. a second pass over stdin
+void png_reader_open_source(PngReader *rd, const PngSource *src) {
+    png_source_memory(&rd->source, src->data, src->size);
+    rd->owns_source = 0;
+    png_reader_start(rd);
+}
+
+void png_reader_read_rows(PngReader *rd, png_bytep *rows, int n) {
+    for (int y = 0; y < n; y++)
+        png_read_row(rd->png, rows[y], NULL);
+}
+
+void png_reader_close(PngReader *rd) {
+    png_destroy_read_struct(&rd->png, &rd->info, NULL);
+    if (rd->owns_source) png_source_close(&rd->source);
+}
+
+png_bytep* read_png_image(const char *path, int *w, int *h, int *channels) {
+    PngReader reader;
+    png_reader_open(&reader, path);
+    *w = reader.w;
+    *h = reader.h;
+    *channels = reader.channels;
+
+    png_bytep *rows = alloc_rows(*h, reader.row_bytes);
+    png_reader_read_rows(&reader, rows, *h);
+
+    png_reader_close(&reader);
+    return rows;
+}
+
+// One allocation holds the row pointers followed by the rows themselves, back to back at a fixed stride;
+// free_rows releases the whole image at once
+png_bytep* alloc_rows(int n, size_t row_bytes) {
+    size_t size = n * (sizeof(png_bytep) + row_bytes);
+    png_bytep *rows = malloc(size ? size : 1);
+    if (!rows) die("malloc rows");
+    stats_count(&run_stats.bytes_allocated, size);
+    png_bytep data = (png_bytep)(rows + n);
+    for (int y = 0; y < n; y++)
+        rows[y] = data + y * row_bytes;
     return rows;
 }
 
+void free_rows(png_bytep *rows) {
+    free(rows);
+}
+
+void collect_colors_streamed(const PngSource *src, int strip_rows, int bit_depth, const Sampler *sampler,
+                             ColorCounts *out) {
+#ifdef _OPENMP
+    int num_threads = omp_get_max_threads();
+#else
+    int num_threads = 1;
+#endif
+
+    ColorHistogram hist;
+    histogram_init(&hist, bit_depth, num_threads);
+    histogram_add_source(&hist, src, strip_rows, sampler);
+    histogram_colors(&hist, out);
+    histogram_free(&hist);
+    stats_count(&run_stats.unique_colors, out->size);
+}
+
+long peak_rss_kib(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+    return usage.ru_maxrss;
+}
+
 static void png_error_fn(png_structp, png_const_charp msg) {
     fprintf(stderr, "PNG error: %s\n", msg);
     die("png error");
@@ -4,19 +4,64 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <time.h>
 #include <png.h>
+#include <zlib.h>
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
 #define INITIAL_N_COLORS 2048
 #define DYNAMIC_CHUNK_SIZE 16
+#define PARALLEL_SCAN_MIN_COLORS 4096
+#define INVERSE_CACHE_SIZE 16384
+#define DENSE_HISTOGRAM_MAX_DEPTH 6
+#define SHARED_STRIP_ROWS 64
+#define MAX_TILE_SIZE 64
+#define CACHE_STRIP_ROWS 64
+#define KMEANS_DEFAULT_THRESHOLD 0.001
+
+// Expands GEN(bit_depth, channels) for every logical depth and for RGB/RGBA rows. Hot row loops are
+// stamped out once per combination so shifts and strides are constants, then picked once per image.
+#define FOR_EACH_PIXEL_FORMAT(GEN) \
+    GEN(1, 3) GEN(1, 4) GEN(2, 3) GEN(2, 4) GEN(3, 3) GEN(3, 4) GEN(4, 3) GEN(4, 4) \
+    GEN(5, 3) GEN(5, 4) GEN(6, 3) GEN(6, 4) GEN(7, 3) GEN(7, 4) GEN(8, 3) GEN(8, 4)
+#define NUM_PIXEL_FORMATS 16
+#define PIXEL_FORMAT_INDEX(bit_depth, channels) (((bit_depth) - 1) * 2 + (channels) - 3)
+// Generic kernel bodies are forced inline into each specialization, where the constants fold
+#define KERNEL_INLINE static inline __attribute__((always_inline))
 
 typedef struct {
     int r, g, b;
-    int count;
 } Color;
 
+// Histogram output: packed 0xRRGGBB keys and their pixel counts, side by side
+typedef struct {
+    uint32_t *keys;
+    uint64_t *counts;
+    size_t size;
+} ColorCounts;
+
+// Per-row PNG filter; the first five values match the PNG filter type bytes
+typedef enum {
+    FILTER_NONE, FILTER_SUB, FILTER_UP, FILTER_AVG, FILTER_PAETH, FILTER_ADAPTIVE
+} RowFilter;
+
+typedef enum {
+    DITHER_NONE, DITHER_FLOYD_STEINBERG, DITHER_ORDERED
+} DitherMode;
+
+typedef enum {
+    SAMPLE_STRATIFIED, SAMPLE_STRIDED
+} SampleMode;
+
+// Headerless index output in place of a PNG: packed rows, or 8x8 bitplane tiles
+typedef enum {
+    RAW_NONE, RAW_LINEAR, RAW_PLANAR, RAW_INTERLEAVED
+} RawFormat;
+
 typedef struct {
     int bit_depth;
     int output_bit_depth;
@@ -24,20 +69,363 @@ typedef struct {
     int skip;
     int preselect;
     int verbose;
+    int strip_rows;
+    const char *stats_path;
+    const char *palette_path;
+    Color *fixed_palette;
+    int fixed_palette_size;
+    const char *shared_palette_path;
+    const char *histogram_path;
+    int tile_size;
+    int compression_level;
+    RowFilter png_filter;
+    DitherMode dither;
+    double sample_fraction;
+    SampleMode sample_mode;
+    int incremental;
+    int kmeans_iterations;
+    double kmeans_threshold;
+    RawFormat raw_format;
+    int raw_bpp;
 } PaletteConfig;
 
+// Histogram sampling: rows and columns are each kept at `rate`, a fraction in 1/2^32 units, so the
+// counted fraction is rate^2. Bands and cells are 1 / rate rows or columns, rounded per band or cell so
+// fractional widths still add up; one row per band and one pixel per cell of it are counted.
+typedef struct {
+    int active;
+    uint32_t rate;
+    int stratified;
+} Sampler;
+
+typedef enum { STAGE_DECODE, STAGE_HISTOGRAM, STAGE_PALETTE, STAGE_REMAP, STAGE_ENCODE, NUM_STAGES } Stage;
+
+// Process-wide counters for the -stats report; updated atomically, so batch runs aggregate
+typedef struct {
+    double wall[NUM_STAGES];
+    double cpu[NUM_STAGES];
+    uint64_t unique_colors;
+    uint64_t hash_probes;
+    uint64_t greedy_iterations;
+    uint64_t kmeans_iterations;
+    uint64_t distance_evals;
+    uint64_t bytes_allocated;
+    uint64_t sampled_pixels;
+    uint64_t reused_strips;
+    double sample_palette_error;
+} RunStats;
+
+typedef struct {
+    double wall;
+    double cpu;
+    int thread_cpu;
+} StageTimer;
+
+// What the previous -cache run on an output left behind: per-strip content hashes, per-strip
+// histograms, the palette and the index rows. Strips are CACHE_STRIP_ROWS rows of the decoded image;
+// a strip's colors have NULL keys until they are counted.
+typedef struct {
+    char *path;
+    int w, h, channels, num_strips;
+    int loaded;
+    uint64_t *hashes;
+    uint8_t *changed;
+    int num_changed;
+    ColorCounts *strip_colors;
+    Color *palette;
+    int palette_size;
+    png_bytep indices;
+} StripCache;
+
+extern RunStats run_stats;
+
+// Encoded PNG bytes: a mapped file, a buffer read from stdin, or caller-owned memory
+typedef struct {
+    const unsigned char *data;
+    size_t size, pos;
+    void *mapping;
+    unsigned char *owned;
+} PngSource;
+
+// Where encoded bytes go: a file, stdout, or a growing memory buffer (fp == NULL)
+typedef struct {
+    FILE *fp;
+    int close_fp;
+    unsigned char *data;
+    size_t size, cap;
+} PngSink;
+
+// Row-at-a-time PNG decoding to 8-bit RGB(A), so images can be processed in strips
+typedef struct {
+    PngSource source;
+    int owns_source;
+    png_structp png;
+    png_infop info;
+    int w, h, channels;
+    size_t row_bytes;
+} PngReader;
+
+// Row-at-a-time indexed PNG encoding
+typedef struct {
+    PngSink sink;
+    png_structp png;
+    png_infop info;
+    int w;
+    int bit_depth;
+    png_bytep packed;
+} PngWriter;
+
+typedef struct {
+    uint32_t key;
+    uint32_t count;
+} ColorBucket;
+
+// Open-addressing (linear probing) table of packed 0xRRGGBB keys
+typedef struct {
+    uint32_t *keys;
+    uint64_t *counts;
+    size_t capacity;
+    size_t size;
+    uint64_t probes;
+    // Set when the table couldn't grow inside a parallel region; the region's owner dies once it ends
+    int failed;
+} ColorTable;
+
+// Per-thread color counts; direct-indexed up to DENSE_HISTOGRAM_MAX_DEPTH, hashed above
+typedef struct {
+    int bit_depth;
+    int num_threads;
+    uint32_t **dense;
+    // Dense slots stay 32-bit; each is folded into the shared 64-bit `wide` before it could overflow
+    uint64_t *wide;
+    uint64_t *pending;
+    ColorTable *tables;
+} ColorHistogram;
+
+typedef struct PaletteSoA PaletteSoA;
+
+// Nearest-color kernels over 16-bit lanes, picked once per CPU (override with QUANTIZE_SIMD=scalar|sse2)
+typedef struct {
+    const char *name;
+    int (*nearest)(const PaletteSoA *p, int r, int g, int b, int *out_dist);
+    void (*update_min)(const PaletteSoA *p, size_t lo, size_t hi, int r, int g, int b, int16_t *best);
+} NearestKernels;
+
+// Structure-of-arrays copy of a color list, padded to the widest vector
+struct PaletteSoA {
+    size_t size;
+    size_t padded;
+    int16_t *r, *g, *b;
+    const NearestKernels *kernels;
+};
+
+// (r,g,b) -> palette index; a dense table when it is cheaper than per-pixel search, else per-thread caches
+typedef struct {
+    int bit_depth;
+    PaletteSoA soa;
+    png_bytep table;
+} InverseColormap;
+
+// Dithering state for one image, carried across dither_rows calls
+typedef struct {
+    DitherMode mode;
+    int w;
+    int next_row;
+    int ring;
+    int32_t *errors;
+    int64_t *progress;
+    int16_t *palette8;
+    int16_t thresholds[64];
+} Dither;
+
+typedef struct {
+    char *in_path;
+    char *out_path;
+} Job;
+
+typedef struct {
+    Job *jobs;
+    int count;
+} JobList;
+
+// Per-worker buffers that persist across jobs; they only grow when an image is larger than any before
+typedef struct {
+    ColorHistogram hist;
+    png_bytep pixels;
+    size_t pixels_cap;
+    png_bytep *rows;
+    int rows_cap;
+    png_bytep indices;
+    size_t indices_cap;
+    png_bytep *index_rows;
+    int index_rows_cap;
+} Workspace;
+
+// Sub-palettes for a tiled image; tiles with identical histograms share one entry of `palettes`
+typedef struct {
+    int tile_size;
+    int tiles_x, tiles_y;
+    int *assignment;
+    Color **palettes;
+    int *palette_sizes;
+    int num_palettes;
+} TilePalettes;
+
+typedef void (*BatchJobFn)(Workspace *ws, const Job *job, const PaletteConfig *config);
+
+// quantize_daemon wire format: native byte order, since both ends share a host over a Unix socket.
+// A request header is followed by path_len bytes of path, or else data_len bytes of PNG;
+// a response header is followed by data_len bytes of PNG, or an error message when status != 0.
+#define DAEMON_MAGIC 0x31514451u
+#define DAEMON_BACKLOG 64
+#define DAEMON_MAX_INPUT ((uint64_t)1 << 30)
+
+typedef struct {
+    uint32_t magic;
+    int32_t bit_depth, output_bit_depth;
+    int32_t max_colors, skip, preselect;
+    int32_t dither, compression_level, png_filter;
+    uint32_t path_len;
+    uint64_t data_len;
+} DaemonRequest;
+
+typedef struct {
+    uint32_t magic;
+    int32_t status;
+    int32_t w, h, palette_size;
+    // From the last request byte received to the response being ready, as measured by the daemon
+    uint64_t latency_us;
+    uint64_t data_len;
+} DaemonResponse;
+
 void die(const char *msg);
-void parse_arguments(int argc, char **argv, PaletteConfig *config, const char **in_path, const char **out_path);
+void set_die_handler(jmp_buf *target);
+void parse_arguments(int argc, char **argv, PaletteConfig *config, JobList *jobs);
+
+void jobs_from_args(JobList *jobs, char **paths, int n);
+void jobs_from_manifest(JobList *jobs, const char *path);
+void jobs_from_inputs(JobList *jobs, char **paths, int n, const char *out_path);
+void free_jobs(JobList *jobs);
+void workspace_init(Workspace *ws, int bit_depth, int num_threads);
+void workspace_free(Workspace *ws);
+png_bytep* workspace_decode(Workspace *ws, const char *path, int *w, int *h, int *channels);
+png_bytep* workspace_decode_source(Workspace *ws, const PngSource *src, int *w, int *h, int *channels);
+png_bytep* workspace_index_rows(Workspace *ws, int w, int h);
+void workspace_collect_colors(Workspace *ws, png_bytep *rows, int w, int h, int channels,
+                              const Sampler *sampler, ColorCounts *out);
+void run_batch(const JobList *jobs, const PaletteConfig *config, BatchJobFn fn);
+double wall_seconds(void);
+
+int unix_socket_listen(const char *path);
+int unix_socket_connect(const char *path);
+int read_full(int fd, void *buf, size_t n);
+int write_full(int fd, const void *buf, size_t n);
+
+StageTimer stage_start(void);
+void stage_stop(Stage stage, StageTimer t);
+void stats_count(uint64_t *counter, uint64_t n);
+void write_run_stats(const char *path, const char *tool, const JobList *jobs, int num_threads, double elapsed);
 
 
 png_bytep* read_png_image(const char *path, int *w, int *h, int *channels);
+void png_source_open(PngSource *src, const char *path);
+void png_source_memory(PngSource *src, const void *data, size_t size);
+void png_source_close(PngSource *src);
+void png_source_read_fn(png_structp png, png_bytep out, size_t n);
+void png_sink_open(PngSink *sink, const char *path);
+void png_sink_write(PngSink *sink, const void *data, size_t n);
+void png_sink_close(PngSink *sink);
+void png_sink_write_fn(png_structp png, png_bytep data, size_t n);
+void png_sink_flush_fn(png_structp png);
+
+void png_reader_open(PngReader *rd, const char *path);
+void png_reader_open_source(PngReader *rd, const PngSource *src);
+void png_reader_read_rows(PngReader *rd, png_bytep *rows, int n);
+void png_reader_close(PngReader *rd);
+png_bytep* alloc_rows(int n, size_t row_bytes);
+void free_rows(png_bytep *rows);
+long peak_rss_kib(void);
+
+void histogram_init(ColorHistogram *hist, int bit_depth, int num_threads);
+void histogram_add_rows(ColorHistogram *hist, png_bytep *rows, int w, int h, int channels);
+void histogram_add_sampled_rows(ColorHistogram *hist, png_bytep *rows, int w, int n, int channels,
+                                int y0, int h, const Sampler *sampler);
+void histogram_add_source(ColorHistogram *hist, const PngSource *src, int strip_rows, const Sampler *sampler);
+void histogram_add_colors(ColorHistogram *hist, const ColorCounts *colors);
+ColorHistogram histogram_slot(const ColorHistogram *hist, int t);
+void histogram_colors(const ColorHistogram *hist, ColorCounts *out);
+void histogram_reset(ColorHistogram *hist);
+void histogram_free(ColorHistogram *hist);
+void put_le32(unsigned char *p, uint32_t v);
+uint32_t get_le32(const unsigned char *p);
+FILE* replace_open(const char *path, char **tmp_path);
+void replace_commit(FILE *out, char *tmp_path, const char *path, int ok);
+void histogram_save(const char *path, const ColorCounts *colors, int bit_depth);
+void histogram_load(const char *path, int bit_depth, ColorCounts *out);
+
+uint32_t hash_key(uint32_t key);
+int pixel_format_index(int bit_depth, int channels);
+void collect_colors(png_bytep *rows, int w, int h, int channels, int bit_depth, ColorCounts *out, int verbose);
+void collect_colors_streamed(const PngSource *src, int strip_rows, int bit_depth, const Sampler *sampler,
+                             ColorCounts *out);
+void color_counts_alloc(ColorCounts *c, size_t n);
+int color_counts_try_alloc(ColorCounts *c, size_t n);
+void color_counts_free(ColorCounts *c);
+void sort_color_counts(ColorCounts *c);
+
+void sampler_init(Sampler *s, const PaletteConfig *config);
+int sampler_takes_row(const Sampler *s, int y, int h);
+int sampler_gather(const Sampler *s, png_const_bytep row, int y, int w, int channels, png_bytep out);
+int sampler_columns(const Sampler *s, int w);
+double sampler_fraction(const Sampler *s);
+void report_sample_error(const ColorCounts *colors, const Color *palette, int pal_size, const PaletteConfig *config);
+Color* build_palette(ColorCounts *colors, const PaletteConfig *config, int *out_pal_size);
+void refine_palette(Color *palette, int pal_size, const ColorCounts *colors, const PaletteConfig *config);
+
+void strip_cache_open(StripCache *c, const char *out_path, png_bytep *rows, int w, int h, int channels,
+                      const PaletteConfig *config);
+void strip_cache_colors(StripCache *c, Workspace *ws, png_bytep *rows, const Sampler *sampler, ColorCounts *out);
+void strip_cache_remap(StripCache *c, png_bytep *rows, png_bytep *index_rows, const Color *palette, int pal_size,
+                       const PaletteConfig *config);
+void strip_cache_save(StripCache *c, png_bytep *index_rows, const Color *palette, int pal_size,
+                      const PaletteConfig *config);
+void strip_cache_free(StripCache *c);
+
+void build_tile_palettes(TilePalettes *tp, png_bytep *rows, int w, int h, int channels, const PaletteConfig *config);
+void write_tile_assignment(const char *path, const TilePalettes *tp);
+void free_tile_palettes(TilePalettes *tp);
+
+const NearestKernels* select_nearest_kernels(void);
+void palette_soa_init(PaletteSoA *p, const Color *colors, size_t n);
+void palette_soa_init_keys(PaletteSoA *p, const uint32_t *keys, size_t n);
+void palette_soa_free(PaletteSoA *p);
 
-Color* collect_colors(png_bytep *rows, int w, int h, int channels, int bit_depth, size_t *out_size, int verbose);
-Color* build_palette(Color *all_colors, size_t num_colors, const PaletteConfig *config, int *out_pal_size);
+void inverse_colormap_init(InverseColormap *map, int bit_depth, const Color *palette, int pal_size, size_t num_pixels);
+void inverse_colormap_free(InverseColormap *map);
+void remap_rows(const InverseColormap *map, png_bytep *rows, png_bytep *out_rows, int w, int h, int channels);
+void dither_init(Dither *d, const InverseColormap *map, DitherMode mode, int w);
+void dither_rows(Dither *d, const InverseColormap *map, png_bytep *rows, png_bytep *out_rows, int n, int channels);
+void dither_free(Dither *d);
 
 png_bytep* quantize_image(png_bytep *rows, int w, int h, int channels, int bit_depth, Color *palette, int pal_size);
-void write_palette_png(const char *path, int w, int h, Color *palette, int pal_size, png_bytep *index_rows);
+int png_index_bit_depth(int pal_size);
+void pack_row(png_bytep unpacked, png_bytep packed, int width, int bit_depth);
+void write_palette_png(const char *path, int w, int h, Color *palette, int pal_size,
+                       png_bytep *index_rows, const PaletteConfig *config);
+void encode_palette_png(PngSink *sink, int w, int h, Color *palette, int pal_size,
+                        png_bytep *index_rows, const PaletteConfig *config);
+int raw_bits_per_pixel(int pal_size, const PaletteConfig *config);
+void write_raw_output(const char *path, int w, int h, Color *palette, int pal_size,
+                      png_bytep *index_rows, const PaletteConfig *config);
+void png_writer_open(PngWriter *wr, const char *path, int w, int h, Color *palette, int pal_size,
+                     const PaletteConfig *config);
+void png_writer_write_rows(PngWriter *wr, png_bytep *index_rows, int n);
+void png_writer_close(PngWriter *wr);
 void write_jasc_palette(const char *path, Color *palette, int pal_size, const PaletteConfig *config);
+void write_jasc_palette_set(const char *path, Color **palettes, const int *pal_sizes, int count, const PaletteConfig *config);
+void write_raw_palette(const char *path, Color *palette, int pal_size, const PaletteConfig *config);
+Color* read_jasc_palette(const char *path, int output_bit_depth, int *pal_size);
 void convert_palette_depth(Color *palette, int pal_size, int bit_depth, int output_bit_depth);
+void reduce_palette_depth(Color *palette, int pal_size, int bit_depth, int output_bit_depth);
 
 #endif // PALETTE_GEN_H